@@ -0,0 +1,198 @@
+#if defined(__linux__)
+#include <dirent.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// NOTE(said): Headless timing runs. --bench runs the configured scene from
+// the same start once per page mode and reports the step time, the dTLB
+// load misses and how much of the process really ended up on huge pages.
+// Misses are counted on every thread of the process, in user space only, so
+// perf_event_paranoid 2 (the usual default) is enough.
+
+#define BENCH_WARMUP_STEPS 10
+#define BENCH_MAX_COUNTERS 256
+
+struct tlb_counters {
+    int Count;
+    int Handles[BENCH_MAX_COUNTERS];
+};
+
+static void
+OpenTLBCounters(tlb_counters *Counters)
+{
+    Counters->Count = 0;
+
+#if defined(__linux__)
+    // NOTE(said): The workers already exist, and an inherited counter only
+    // sees threads created after it, so open one per thread instead.
+    DIR *Tasks = opendir("/proc/self/task");
+    if (!Tasks) {
+        return;
+    }
+
+    int Error = 0;
+    struct dirent *Entry;
+    while ((Entry = readdir(Tasks))) {
+        int Tid = atoi(Entry->d_name);
+        if (Tid <= 0 || Counters->Count == BENCH_MAX_COUNTERS) {
+            continue;
+        }
+
+        perf_event_attr Attr = {};
+        Attr.size = sizeof(Attr);
+        Attr.type = PERF_TYPE_HW_CACHE;
+        Attr.config = (PERF_COUNT_HW_CACHE_DTLB |
+                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        Attr.disabled = 1;
+        Attr.exclude_kernel = 1;
+        Attr.exclude_hv = 1;
+
+        int Handle = (int)syscall(SYS_perf_event_open, &Attr, Tid, -1, -1, 0);
+        if (Handle != -1) {
+            Counters->Handles[Counters->Count++] = Handle;
+        } else if (!Error) {
+            Error = errno;
+        }
+    }
+    closedir(Tasks);
+
+    if (Counters->Count == 0) {
+        printf("No dTLB counters: %s\n", strerror(Error));
+    }
+#endif
+}
+
+static void
+StartTLBCounters(tlb_counters *Counters)
+{
+#if defined(__linux__)
+    for (int i = 0; i < Counters->Count; ++i) {
+        ioctl(Counters->Handles[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(Counters->Handles[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static uint64_t
+StopTLBCounters(tlb_counters *Counters)
+{
+    uint64_t Total = 0;
+
+#if defined(__linux__)
+    for (int i = 0; i < Counters->Count; ++i) {
+        ioctl(Counters->Handles[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        uint64_t Value = 0;
+        if (read(Counters->Handles[i], &Value, sizeof(Value)) == sizeof(Value)) {
+            Total += Value;
+        }
+    }
+#endif
+
+    return Total;
+}
+
+static void
+CloseTLBCounters(tlb_counters *Counters)
+{
+#if defined(__linux__)
+    for (int i = 0; i < Counters->Count; ++i) {
+        close(Counters->Handles[i]);
+    }
+#endif
+    Counters->Count = 0;
+}
+
+// NOTE(said): Transparent and explicit huge pages in the whole process,
+// asking for them doesn't mean the kernel handed any out.
+static size_t
+GetHugePageBytes()
+{
+    size_t Result = 0;
+
+#if defined(__linux__)
+    FILE *File = fopen("/proc/self/smaps_rollup", "r");
+    if (File) {
+        char Line[256];
+        while (fgets(Line, sizeof(Line), File)) {
+            unsigned long long Kilobytes = 0;
+            if (sscanf(Line, "AnonHugePages: %llu kB", &Kilobytes) == 1 ||
+                sscanf(Line, "Private_Hugetlb: %llu kB", &Kilobytes) == 1) {
+                Result += Kilobytes * 1024;
+            }
+        }
+        fclose(File);
+    }
+#endif
+
+    return Result;
+}
+
+static bool
+RunBench(sim_config *Config, int StepCount)
+{
+    static const char *ModeNames[] = {"off", "transparent", "explicit"};
+
+    double BaseSeconds = 0.0;
+    uint64_t BaseMisses = 0;
+
+    for (int Mode = PageMode_Normal; Mode <= PageMode_Explicit; ++Mode) {
+        sim_config ModeConfig = *Config;
+        ModeConfig.HugePages = (page_mode)Mode;
+
+        sim Sim = {};
+        InitSim(&Sim, &ModeConfig);
+
+        // NOTE(said): Lets the grid table and the step arena settle.
+        for (int Step = 0; Step < BENCH_WARMUP_STEPS; ++Step) {
+            Simulate(&Sim);
+        }
+
+        tlb_counters Counters = {};
+        OpenTLBCounters(&Counters);
+
+        StartTLBCounters(&Counters);
+        uint64_t StartCounter = SDL_GetPerformanceCounter();
+        for (int Step = 0; Step < StepCount; ++Step) {
+            Simulate(&Sim);
+        }
+        uint64_t EndCounter = SDL_GetPerformanceCounter();
+        uint64_t Misses = StopTLBCounters(&Counters);
+
+        double Seconds = (double)(EndCounter - StartCounter) / (double)SDL_GetPerformanceFrequency();
+        size_t HugeBytes = GetHugePageBytes();
+
+        size_t AskedBytes = 1024 * (size_t)(SDL_AtomicGet(&GlobalPageStats.Kilobytes[PageMode_Transparent]) +
+                                            SDL_AtomicGet(&GlobalPageStats.Kilobytes[PageMode_Explicit]));
+
+        if (Mode == PageMode_Normal) {
+            BaseSeconds = Seconds;
+            BaseMisses = Misses;
+        }
+
+        printf("huge_pages=%-11s %8.3f ms/step (%5.2fx)", ModeNames[Mode],
+               1000.0 * Seconds / StepCount, BaseSeconds / Seconds);
+        if (Counters.Count) {
+            printf("  %12.0f dTLB misses/step (%5.2fx)", (double)Misses / StepCount,
+                   Misses ? (double)BaseMisses / (double)Misses : 0.0);
+        }
+        printf("  %.1f of %.1f MB on huge pages\n", HugeBytes / (1024.0 * 1024.0), AskedBytes / (1024.0 * 1024.0));
+
+        if (Mode == PageMode_Normal) {
+            memory_usage Memory = {};
+            GetSimMemoryUsage(&Sim, &Memory);
+            printf("  particles %.1f MB, grid table %.1f MB, step arena %.1f MB\n",
+                   Memory.Particles / (1024.0 * 1024.0), Memory.HashGrid / (1024.0 * 1024.0),
+                   Memory.StepArena / (1024.0 * 1024.0));
+        }
+
+        CloseTLBCounters(&Counters);
+        FreeSim(&Sim);
+    }
+
+    return true;
+}
@@ -0,0 +1,233 @@
+// NOTE(said): Checkpoint layout is the header, the config as text (same
+// format as a config file) and then the raw particle array, starting on a
+// page boundary so a restore can map it and use it in place.
+#define CHECKPOINT_MAGIC 0x54504b43 // "CKPT"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_ALIGNMENT 4096
+
+struct checkpoint_header {
+    uint32_t Magic;
+    uint32_t Version;
+
+    // NOTE(said): Changing particle needs a version bump, this catches
+    // the times somebody forgets.
+    uint32_t ParticleSize;
+    uint32_t ConfigSize;
+    uint64_t ConfigOffset;
+    uint64_t ParticleOffset;
+    int ParticleCount;
+
+    uint64_t StepIndex;
+    float Time;
+    float LastDt;
+    float NextDt;
+    v2 Gravity;
+
+    // NOTE(said): Emitter state, so a restored run emits the same particles.
+    uint64_t RandomState;
+    float EmitAccumulator;
+};
+
+struct checkpoint_writer {
+    // NOTE(said): Set while the writer thread owns everything below.
+    SDL_atomic_t Busy;
+
+    char FileName[256];
+    checkpoint_header Header;
+    sim_config Config;
+
+    int ParticleCapacity;
+    particle *Particles;
+};
+
+static bool
+WriteCheckpointFile(const char *FileName, checkpoint_header *Header, sim_config *Config, particle *Particles)
+{
+    // NOTE(said): Write next to the old checkpoint and swap it in at the end,
+    // so a crash halfway through still leaves the last good one.
+    char TempName[260];
+    snprintf(TempName, sizeof(TempName), "%s.tmp", FileName);
+
+    FILE *File = fopen(TempName, "wb");
+    if (!File) {
+        printf("Couldn't open '%s' for writing\n", TempName);
+        return false;
+    }
+
+    fwrite(Header, sizeof(*Header), 1, File);
+
+    Header->ConfigOffset = ftell(File);
+    PrintSimConfig(File, Config);
+    Header->ConfigSize = (uint32_t)(ftell(File) - Header->ConfigOffset);
+
+    long Offset = ftell(File);
+    while (Offset % CHECKPOINT_ALIGNMENT) {
+        fputc(0, File);
+        ++Offset;
+    }
+    Header->ParticleOffset = Offset;
+
+    fwrite(Particles, sizeof(particle), Header->ParticleCount, File);
+
+    fseek(File, 0, SEEK_SET);
+    fwrite(Header, sizeof(*Header), 1, File);
+
+    bool Result = !ferror(File);
+    Result = (fclose(File) == 0) && Result;
+
+    if (Result) {
+#if defined(_WIN32)
+        remove(FileName);
+#endif
+        Result = rename(TempName, FileName) == 0;
+    }
+
+    if (!Result) {
+        printf("Couldn't write checkpoint '%s'\n", FileName);
+        remove(TempName);
+    }
+
+    return Result;
+}
+
+static int
+CheckpointWriterProc(void *Data)
+{
+    checkpoint_writer *Writer = (checkpoint_writer *)Data;
+
+    if (WriteCheckpointFile(Writer->FileName, &Writer->Header, &Writer->Config, Writer->Particles)) {
+        printf("Wrote checkpoint '%s' at t=%g\n", Writer->FileName, Writer->Header.Time);
+    }
+
+    SDL_AtomicSet(&Writer->Busy, 0);
+    return 0;
+}
+
+// NOTE(said): Copies what it needs out of the snapshot and writes it on its
+// own thread, so the snapshot can go back to the triple buffer right away.
+// Only one checkpoint is in flight at a time, returns false if one still is.
+static bool
+BeginCheckpointWrite(checkpoint_writer *Writer, sim_snapshot *Snapshot, const char *FileName)
+{
+    if (!SDL_AtomicCAS(&Writer->Busy, 0, 1)) {
+        printf("Still writing the last checkpoint\n");
+        return false;
+    }
+
+    if (Writer->ParticleCapacity < Snapshot->ParticleCount) {
+        Writer->ParticleCapacity = Snapshot->ParticleCount;
+        Writer->Particles = (particle *)realloc(Writer->Particles, Writer->ParticleCapacity * sizeof(particle));
+    }
+    memcpy(Writer->Particles, Snapshot->Particles, Snapshot->ParticleCount * sizeof(particle));
+
+    snprintf(Writer->FileName, sizeof(Writer->FileName), "%s", FileName);
+    Writer->Config = Snapshot->Config;
+
+    checkpoint_header *Header = &Writer->Header;
+    *Header = {};
+    Header->Magic = CHECKPOINT_MAGIC;
+    Header->Version = CHECKPOINT_VERSION;
+    Header->ParticleSize = sizeof(particle);
+    Header->ParticleCount = Snapshot->ParticleCount;
+    Header->StepIndex = Snapshot->StepIndex;
+    Header->Time = Snapshot->Time;
+    Header->LastDt = Snapshot->Dt;
+    Header->NextDt = Snapshot->NextDt;
+    Header->Gravity = Snapshot->Gravity;
+    Header->RandomState = Snapshot->Series.State;
+    Header->EmitAccumulator = Snapshot->EmitAccumulator;
+
+    SDL_Thread *Thread = SDL_CreateThread(CheckpointWriterProc, "CheckpointWriter", Writer);
+    if (!Thread) {
+        printf("Couldn't start the checkpoint writer: %s\n", SDL_GetError());
+        SDL_AtomicSet(&Writer->Busy, 0);
+        return false;
+    }
+    SDL_DetachThread(Thread);
+
+    return true;
+}
+
+static void
+WaitForCheckpointWriter(checkpoint_writer *Writer)
+{
+    while (SDL_AtomicGet(&Writer->Busy)) {
+        SDL_Delay(1);
+    }
+}
+
+static bool
+RestoreCheckpoint(sim *Sim, const char *FileName)
+{
+    size_t Size = 0;
+    uint8_t *Base = MapFile(FileName, &Size);
+
+    if (!Base) {
+        printf("Couldn't read checkpoint '%s'\n", FileName);
+        return false;
+    }
+
+    // NOTE(said): A copy, the mapping can go away when the particles are
+    // copied out below.
+    checkpoint_header Header = {};
+    if (Size >= sizeof(Header)) {
+        memcpy(&Header, Base, sizeof(Header));
+    }
+
+    bool Valid = (Header.Magic == CHECKPOINT_MAGIC &&
+                  Header.Version == CHECKPOINT_VERSION &&
+                  Header.ParticleSize == sizeof(particle) &&
+                  Header.ParticleCount >= 0 &&
+                  Header.ConfigOffset + Header.ConfigSize <= Size &&
+                  Header.ParticleOffset % CHECKPOINT_ALIGNMENT == 0 &&
+                  Header.ParticleOffset + (uint64_t)Header.ParticleCount * sizeof(particle) <= Size);
+
+    sim_config Config = DefaultSimConfig();
+    if (Valid) {
+        char *ConfigText = (char *)malloc(Header.ConfigSize + 1);
+        memcpy(ConfigText, Base + Header.ConfigOffset, Header.ConfigSize);
+        ConfigText[Header.ConfigSize] = 0;
+
+        Valid = ParseSimConfigText(&Config, ConfigText) && ValidateSimConfig(&Config);
+        free(ConfigText);
+    }
+
+    if (!Valid) {
+        printf("'%s' is not a version %d checkpoint\n", FileName, CHECKPOINT_VERSION);
+        UnmapFile(Base, Size);
+        return false;
+    }
+
+    SetupSim(Sim, &Config);
+
+    Sim->ParticleCount = Header.ParticleCount;
+    Sim->ParticleCapacity = Header.ParticleCount;
+    Sim->Particles = (particle *)(Base + Header.ParticleOffset);
+    Sim->ParticleMapping = Base;
+    Sim->ParticleMappingSize = Size;
+
+    // NOTE(said): A file mapping never gets huge pages, so with those asked
+    // for the particles are copied out even if the pool doesn't grow. A sink
+    // can drain every particle, then the mapping has none and the pool is
+    // always allocated.
+    int Capacity = GetParticlePoolSize(&Config);
+    if (Capacity < Header.ParticleCount) {
+        Capacity = Header.ParticleCount;
+    }
+    if (Config.HugePages != PageMode_Normal) {
+        Sim->ParticleCapacity = 0;
+    }
+    ReserveParticles(Sim, Capacity);
+
+    Sim->StepIndex = Header.StepIndex;
+    Sim->Time = Header.Time;
+    Sim->LastDt = Header.LastDt;
+    Sim->Dt = Header.NextDt;
+    Sim->Gravity = Header.Gravity;
+    Sim->Series.State = Header.RandomState;
+    Sim->EmitAccumulator = Header.EmitAccumulator;
+
+    printf("Restored %d particles at t=%g from '%s'\n", Sim->ParticleCount, Sim->Time, FileName);
+
+    return true;
+}
@@ -0,0 +1,277 @@
+enum config_field_type {
+    ConfigField_Int,
+    ConfigField_Float,
+    ConfigField_GridOrder,
+    ConfigField_PageMode,
+};
+
+struct config_field {
+    const char *Name;
+    config_field_type Type;
+    size_t Offset;
+};
+
+static config_field SimConfigFields[] = {
+    {"particles_per_axis", ConfigField_Int, offsetof(sim_config, ParticlesPerAxis)},
+    {"particle_radius", ConfigField_Float, offsetof(sim_config, ParticleRadius)},
+    {"particle_mass", ConfigField_Float, offsetof(sim_config, ParticleMass)},
+    {"dt", ConfigField_Float, offsetof(sim_config, Dt)},
+    {"adaptive_dt", ConfigField_Int, offsetof(sim_config, AdaptiveDt)},
+    {"min_dt", ConfigField_Float, offsetof(sim_config, MinDt)},
+    {"max_dt", ConfigField_Float, offsetof(sim_config, MaxDt)},
+    {"cfl", ConfigField_Float, offsetof(sim_config, Cfl)},
+    {"max_density_error", ConfigField_Float, offsetof(sim_config, MaxDensityError)},
+    {"rest_density", ConfigField_Float, offsetof(sim_config, RestDensity)},
+    {"relaxation", ConfigField_Float, offsetof(sim_config, Relaxation)},
+    {"h", ConfigField_Float, offsetof(sim_config, H)},
+    {"scorr_k", ConfigField_Float, offsetof(sim_config, ScorrK)},
+    {"scorr_dq", ConfigField_Float, offsetof(sim_config, ScorrDeltaQ)},
+    {"elasticity", ConfigField_Float, offsetof(sim_config, Elasticity)},
+    {"world_width", ConfigField_Float, offsetof(sim_config, WorldWidth)},
+    {"world_height", ConfigField_Float, offsetof(sim_config, WorldHeight)},
+    {"gravity_x", ConfigField_Float, offsetof(sim_config, Gravity) + offsetof(v2, x)},
+    {"gravity_y", ConfigField_Float, offsetof(sim_config, Gravity) + offsetof(v2, y)},
+    {"grid_order", ConfigField_GridOrder, offsetof(sim_config, GridOrder)},
+    {"symmetric_lambda", ConfigField_Int, offsetof(sim_config, SymmetricLambda)},
+    {"colored_delta_p", ConfigField_Int, offsetof(sim_config, ColoredDeltaP)},
+    {"deterministic", ConfigField_Int, offsetof(sim_config, Deterministic)},
+    {"seed", ConfigField_Int, offsetof(sim_config, Seed)},
+    {"initial_jitter", ConfigField_Float, offsetof(sim_config, InitialJitter)},
+    {"particle_capacity", ConfigField_Int, offsetof(sim_config, ParticleCapacity)},
+    {"emitter_x", ConfigField_Float, offsetof(sim_config, Emitter) + offsetof(particle_emitter, P) + offsetof(v2, x)},
+    {"emitter_y", ConfigField_Float, offsetof(sim_config, Emitter) + offsetof(particle_emitter, P) + offsetof(v2, y)},
+    {"emitter_radius", ConfigField_Float, offsetof(sim_config, Emitter) + offsetof(particle_emitter, Radius)},
+    {"emitter_rate", ConfigField_Float, offsetof(sim_config, Emitter) + offsetof(particle_emitter, Rate)},
+    {"emitter_vx", ConfigField_Float, offsetof(sim_config, Emitter) + offsetof(particle_emitter, V) + offsetof(v2, x)},
+    {"emitter_vy", ConfigField_Float, offsetof(sim_config, Emitter) + offsetof(particle_emitter, V) + offsetof(v2, y)},
+    {"sink_x", ConfigField_Float, offsetof(sim_config, Sink) + offsetof(particle_sink, P) + offsetof(v2, x)},
+    {"sink_y", ConfigField_Float, offsetof(sim_config, Sink) + offsetof(particle_sink, P) + offsetof(v2, y)},
+    {"sink_radius", ConfigField_Float, offsetof(sim_config, Sink) + offsetof(particle_sink, Radius)},
+    {"huge_pages", ConfigField_PageMode, offsetof(sim_config, HugePages)},
+};
+
+static const char *GridOrderNames[] = {
+    "row_major",
+    "morton",
+};
+
+static const char *PageModeNames[] = {
+    "off",
+    "transparent",
+    "explicit",
+};
+
+static bool
+SetSimConfigValue(sim_config *Config, const char *Name, const char *Value)
+{
+    config_field *Field = 0;
+    for (int i = 0; i < (int)ArrayCount(SimConfigFields); ++i) {
+        if (strcmp(SimConfigFields[i].Name, Name) == 0) {
+            Field = SimConfigFields + i;
+            break;
+        }
+    }
+
+    if (!Field) {
+        printf("Unknown config option '%s'\n", Name);
+        return false;
+    }
+
+    uint8_t *Dest = (uint8_t *)Config + Field->Offset;
+    char *End = 0;
+
+    switch (Field->Type) {
+        case ConfigField_Int: {
+            long Result = strtol(Value, &End, 10);
+            if (End == Value || *End) break;
+            *(int *)Dest = (int)Result;
+            return true;
+        } break;
+
+        case ConfigField_Float: {
+            float Result = strtof(Value, &End);
+            if (End == Value || *End) break;
+            *(float *)Dest = Result;
+            return true;
+        } break;
+
+        case ConfigField_GridOrder: {
+            for (int i = 0; i < (int)ArrayCount(GridOrderNames); ++i) {
+                if (strcmp(GridOrderNames[i], Value) == 0) {
+                    *(grid_order *)Dest = (grid_order)i;
+                    return true;
+                }
+            }
+        } break;
+
+        case ConfigField_PageMode: {
+            for (int i = 0; i < (int)ArrayCount(PageModeNames); ++i) {
+                if (strcmp(PageModeNames[i], Value) == 0) {
+                    *(page_mode *)Dest = (page_mode)i;
+                    return true;
+                }
+            }
+        } break;
+    }
+
+    printf("Invalid value '%s' for config option '%s'\n", Value, Name);
+    return false;
+}
+
+static char *
+TrimWhitespace(char *String)
+{
+    while (*String == ' ' || *String == '\t') {
+        ++String;
+    }
+
+    char *End = String + strlen(String);
+    while (End > String && (End[-1] == ' ' || End[-1] == '\t' || End[-1] == '\r' || End[-1] == '\n')) {
+        --End;
+    }
+    *End = 0;
+
+    return String;
+}
+
+// NOTE(said): Parses "name=value", with optional whitespace around the '='.
+static bool
+ParseSimConfigAssignment(sim_config *Config, char *Line)
+{
+    char Buffer[256];
+    if (strlen(Line) >= sizeof(Buffer)) {
+        printf("Config line too long: '%s'\n", Line);
+        return false;
+    }
+    strcpy(Buffer, Line);
+
+    char *Equals = strchr(Buffer, '=');
+    if (!Equals) {
+        printf("Expected name=value, got '%s'\n", Line);
+        return false;
+    }
+    *Equals = 0;
+
+    char *Name = TrimWhitespace(Buffer);
+    char *Value = TrimWhitespace(Equals + 1);
+
+    return SetSimConfigValue(Config, Name, Value);
+}
+
+// NOTE(said): One name = value per line, '#' starts a comment.
+static bool
+LoadSimConfigFile(sim_config *Config, const char *FileName)
+{
+    FILE *File = fopen(FileName, "r");
+    if (!File) {
+        printf("Couldn't open config file '%s'\n", FileName);
+        return false;
+    }
+
+    bool Result = true;
+    int LineNumber = 0;
+
+    char Line[256];
+    while (fgets(Line, sizeof(Line), File)) {
+        ++LineNumber;
+
+        char *Comment = strchr(Line, '#');
+        if (Comment) {
+            *Comment = 0;
+        }
+
+        char *Trimmed = TrimWhitespace(Line);
+        if (!*Trimmed) {
+            continue;
+        }
+
+        if (!ParseSimConfigAssignment(Config, Trimmed)) {
+            printf("  in %s:%d\n", FileName, LineNumber);
+            Result = false;
+            break;
+        }
+    }
+
+    fclose(File);
+
+    return Result;
+}
+
+// NOTE(said): Config text as written by PrintSimConfig, for configs stored
+// inside other files. Modifies Text.
+static bool
+ParseSimConfigText(sim_config *Config, char *Text)
+{
+    for (char *Line = strtok(Text, "\n"); Line; Line = strtok(0, "\n")) {
+        char *Trimmed = TrimWhitespace(Line);
+        if (*Trimmed && !ParseSimConfigAssignment(Config, Trimmed)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+ValidateSimConfig(sim_config *Config)
+{
+    bool Valid = true;
+
+#define CHECK(Condition) if (!(Condition)) { printf("Invalid config: %s\n", #Condition); Valid = false; }
+    CHECK(Config->ParticlesPerAxis > 0);
+    CHECK(Config->ParticleRadius > 0);
+    CHECK(Config->ParticleMass > 0);
+    CHECK(Config->Dt > 0);
+    CHECK(Config->AdaptiveDt == 0 || Config->AdaptiveDt == 1);
+    CHECK(Config->MinDt > 0);
+    CHECK(Config->MaxDt >= Config->MinDt);
+    CHECK(Config->Cfl > 0);
+    CHECK(Config->MaxDensityError > 0);
+    CHECK(Config->RestDensity > 0);
+    CHECK(Config->Relaxation >= 0);
+    CHECK(Config->H > 0);
+    CHECK(Config->ScorrDeltaQ > 0 && Config->ScorrDeltaQ < 1);
+    CHECK(Config->WorldWidth > 0);
+    CHECK(Config->WorldHeight > 0);
+
+    // NOTE(said): The world starts at the biased origin, cells past the far
+    // edge would clamp onto each other and share keys.
+    CHECK(Config->WorldWidth / Config->H < HASH_GRID_MAX_COORD - HASH_GRID_COORD_BIAS);
+    CHECK(Config->WorldHeight / Config->H < HASH_GRID_MAX_COORD - HASH_GRID_COORD_BIAS);
+    CHECK(Config->SymmetricLambda == 0 || Config->SymmetricLambda == 1);
+    CHECK(Config->ColoredDeltaP == 0 || Config->ColoredDeltaP == 1);
+    CHECK(Config->Deterministic == 0 || Config->Deterministic == 1);
+    CHECK(Config->InitialJitter >= 0);
+    CHECK(Config->ParticleCapacity >= 0);
+    CHECK(Config->Emitter.Radius >= 0);
+    CHECK(Config->Emitter.Rate >= 0);
+    CHECK(Config->Sink.Radius >= 0);
+#undef CHECK
+
+    return Valid;
+}
+
+// NOTE(said): Prints in the config file format, floats with as few digits
+// as read back to the same value, so the output can be loaded again exactly.
+static void
+PrintSimConfig(FILE *File, sim_config *Config)
+{
+    for (int i = 0; i < (int)ArrayCount(SimConfigFields); ++i) {
+        config_field *Field = SimConfigFields + i;
+        uint8_t *Src = (uint8_t *)Config + Field->Offset;
+
+        switch (Field->Type) {
+            case ConfigField_Int: fprintf(File, "%s = %d\n", Field->Name, *(int *)Src); break;
+            case ConfigField_Float: {
+                float Value = *(float *)Src;
+                char Buffer[32];
+                for (int Digits = 6; Digits <= 9; ++Digits) {
+                    snprintf(Buffer, sizeof(Buffer), "%.*g", Digits, Value);
+                    if (strtof(Buffer, 0) == Value) break;
+                }
+                fprintf(File, "%s = %s\n", Field->Name, Buffer);
+            } break;
+            case ConfigField_GridOrder: fprintf(File, "%s = %s\n", Field->Name, GridOrderNames[*(grid_order *)Src]); break;
+            case ConfigField_PageMode: fprintf(File, "%s = %s\n", Field->Name, PageModeNames[*(page_mode *)Src]); break;
+        }
+    }
+}
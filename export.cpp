@@ -0,0 +1,787 @@
+// NOTE(said): Frame export. The file starts with a header and the config as
+// text, then one frame after another, each a frame header and a payload.
+// The payload has one array per exported field (positions, velocities,
+// densities) in sorted-grid order. The sim thread hands frames to a bounded
+// queue and a writer thread does all the file I/O.
+//
+// Payloads are either raw float arrays or quantized. Quantized frames turn
+// every value into an integer step count, take the difference to the same
+// index in the previous frame (or to the previous particle on key frames),
+// and range code the differences. The writer thread does the encoding.
+#define EXPORT_MAGIC 0x58464250 // "PBFX"
+#define EXPORT_FRAME_MAGIC 0x4d415246 // "FRAM"
+#define EXPORT_VERSION 1
+
+#define EXPORT_QUEUE_SIZE 8
+
+enum export_field {
+    ExportField_P = 0x1,
+    ExportField_V = 0x2,
+    ExportField_Density = 0x4,
+};
+
+enum export_encoding {
+    ExportEncoding_Raw,
+    ExportEncoding_QuantizedKey,
+    ExportEncoding_QuantizedDelta,
+};
+
+// NOTE(said): Key frames are coded on their own so a reader can start
+// decoding there.
+#define EXPORT_KEY_FRAME_INTERVAL 32
+
+#define EXPORT_MAX_COMPONENTS 5
+
+// NOTE(said): More than a float has for positions in the world anyway.
+#define EXPORT_MAX_POSITION_BITS 24
+#define EXPORT_DEFAULT_VELOCITY_STEP 0.001f
+#define EXPORT_DEFAULT_DENSITY_STEP 0.1f
+
+// NOTE(said): Start of every quantized payload. Positions are fixed point
+// in the world bounds, everything else is a multiple of its step, so the
+// error is at most half a step.
+struct export_quantization {
+    uint32_t PositionBits;
+    v2 Min;
+    v2 PositionStep;
+    float VelocityStep;
+    float DensityStep;
+};
+
+struct export_file_header {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t Fields;
+    uint32_t ConfigSize;
+};
+
+struct export_frame_header {
+    uint32_t Magic;
+    uint32_t FrameIndex;
+    uint64_t StepIndex;
+    float Time;
+    float Dt;
+    int ParticleCount;
+    uint32_t Encoding;
+    uint32_t PayloadSize;
+};
+
+struct export_frame {
+    export_frame_header Header;
+    uint32_t PayloadCapacity;
+    uint8_t *Payload;
+};
+
+struct exporter {
+    FILE *File;
+    uint32_t Fields;
+    uint32_t FrameIndex;
+
+    uint32_t Encoding;
+    export_quantization Quantization;
+
+    // NOTE(said): Writer thread only. Quantized values of the last frame
+    // written, one array per component.
+    int PreviousCount;
+    int PreviousCapacity;
+    int32_t *Previous[EXPORT_MAX_COMPONENTS];
+    uint32_t EncodedCapacity;
+    uint8_t *Encoded;
+
+    // NOTE(said): What the writer's buffers above add up to, updated under
+    // the lock so the sim thread can read it.
+    size_t EncoderMemory;
+
+    SDL_mutex *Mutex;
+    SDL_cond *NotEmpty;
+    SDL_cond *NotFull;
+
+    // NOTE(said): Ring of frames, [ReadIndex, ReadIndex + Count) are
+    // waiting for the writer.
+    export_frame Frames[EXPORT_QUEUE_SIZE];
+    int ReadIndex;
+    int Count;
+    bool Stopping;
+
+    SDL_Thread *Thread;
+
+    int StallCount;
+    uint64_t RawBytes;
+    uint64_t BytesWritten;
+    bool WriteFailed;
+};
+
+// NOTE(said): Range coder with adaptive bit probabilities, the same scheme
+// LZMA uses.
+#define RANGE_PROB_BITS 11
+#define RANGE_PROB_INIT (1 << (RANGE_PROB_BITS - 1))
+#define RANGE_MOVE_BITS 5
+#define RANGE_TOP (1u << 24)
+
+struct range_encoder {
+    uint64_t Low;
+    uint32_t Range;
+    uint8_t Cache;
+    uint64_t CacheSize;
+
+    uint8_t *At;
+    uint8_t *End;
+};
+
+struct range_decoder {
+    uint32_t Code;
+    uint32_t Range;
+
+    uint8_t *At;
+    uint8_t *End;
+    bool Overrun;
+};
+
+// NOTE(said): Signed difference per value, coded as the bit length of its
+// zigzag form with a bit tree and then the bits below the leading one. The
+// first of those gets a probability per length, the rest go in raw.
+struct value_model {
+    uint16_t Length[64];
+    uint16_t High[33];
+};
+
+static void
+InitValueModel(value_model *Model)
+{
+    for (int i = 0; i < (int)ArrayCount(Model->Length); ++i) {
+        Model->Length[i] = RANGE_PROB_INIT;
+    }
+    for (int i = 0; i < (int)ArrayCount(Model->High); ++i) {
+        Model->High[i] = RANGE_PROB_INIT;
+    }
+}
+
+static void
+ShiftLow(range_encoder *Encoder)
+{
+    if ((uint32_t)Encoder->Low < 0xff000000 || (Encoder->Low >> 32) != 0) {
+        uint8_t Carry = (uint8_t)(Encoder->Low >> 32);
+        uint8_t Byte = Encoder->Cache;
+        do {
+            assert(Encoder->At < Encoder->End);
+            *Encoder->At++ = Byte + Carry;
+            Byte = 0xff;
+        } while (--Encoder->CacheSize != 0);
+        Encoder->Cache = (uint8_t)(Encoder->Low >> 24);
+    }
+    ++Encoder->CacheSize;
+    Encoder->Low = (Encoder->Low & 0x00ffffff) << 8;
+}
+
+static void
+InitRangeEncoder(range_encoder *Encoder, uint8_t *Out, uint8_t *End)
+{
+    *Encoder = {};
+    Encoder->Range = 0xffffffff;
+    Encoder->CacheSize = 1;
+    Encoder->At = Out;
+    Encoder->End = End;
+}
+
+static void
+EncodeBit(range_encoder *Encoder, uint16_t *Prob, uint32_t Bit)
+{
+    uint32_t Bound = (Encoder->Range >> RANGE_PROB_BITS) * *Prob;
+    if (Bit) {
+        Encoder->Low += Bound;
+        Encoder->Range -= Bound;
+        *Prob -= *Prob >> RANGE_MOVE_BITS;
+    } else {
+        Encoder->Range = Bound;
+        *Prob += ((1 << RANGE_PROB_BITS) - *Prob) >> RANGE_MOVE_BITS;
+    }
+    while (Encoder->Range < RANGE_TOP) {
+        Encoder->Range <<= 8;
+        ShiftLow(Encoder);
+    }
+}
+
+static void
+EncodeDirectBits(range_encoder *Encoder, uint32_t Value, int BitCount)
+{
+    for (int i = BitCount - 1; i >= 0; --i) {
+        Encoder->Range >>= 1;
+        if ((Value >> i) & 1) {
+            Encoder->Low += Encoder->Range;
+        }
+        while (Encoder->Range < RANGE_TOP) {
+            Encoder->Range <<= 8;
+            ShiftLow(Encoder);
+        }
+    }
+}
+
+static void
+FlushRangeEncoder(range_encoder *Encoder)
+{
+    for (int i = 0; i < 5; ++i) {
+        ShiftLow(Encoder);
+    }
+}
+
+static uint8_t
+NextByte(range_decoder *Decoder)
+{
+    if (Decoder->At < Decoder->End) {
+        return *Decoder->At++;
+    }
+    Decoder->Overrun = true;
+    return 0;
+}
+
+static void
+InitRangeDecoder(range_decoder *Decoder, uint8_t *In, uint8_t *End)
+{
+    *Decoder = {};
+    Decoder->Range = 0xffffffff;
+    Decoder->At = In;
+    Decoder->End = End;
+    for (int i = 0; i < 5; ++i) {
+        Decoder->Code = (Decoder->Code << 8) | NextByte(Decoder);
+    }
+}
+
+static uint32_t
+DecodeBit(range_decoder *Decoder, uint16_t *Prob)
+{
+    uint32_t Bit;
+    uint32_t Bound = (Decoder->Range >> RANGE_PROB_BITS) * *Prob;
+    if (Decoder->Code < Bound) {
+        Decoder->Range = Bound;
+        *Prob += ((1 << RANGE_PROB_BITS) - *Prob) >> RANGE_MOVE_BITS;
+        Bit = 0;
+    } else {
+        Decoder->Code -= Bound;
+        Decoder->Range -= Bound;
+        *Prob -= *Prob >> RANGE_MOVE_BITS;
+        Bit = 1;
+    }
+    while (Decoder->Range < RANGE_TOP) {
+        Decoder->Range <<= 8;
+        Decoder->Code = (Decoder->Code << 8) | NextByte(Decoder);
+    }
+    return Bit;
+}
+
+static uint32_t
+DecodeDirectBits(range_decoder *Decoder, int BitCount)
+{
+    uint32_t Value = 0;
+    for (int i = 0; i < BitCount; ++i) {
+        Decoder->Range >>= 1;
+        uint32_t Bit = Decoder->Code >= Decoder->Range;
+        if (Bit) {
+            Decoder->Code -= Decoder->Range;
+        }
+        Value = (Value << 1) | Bit;
+        while (Decoder->Range < RANGE_TOP) {
+            Decoder->Range <<= 8;
+            Decoder->Code = (Decoder->Code << 8) | NextByte(Decoder);
+        }
+    }
+    return Value;
+}
+
+static void
+EncodeValue(range_encoder *Encoder, value_model *Model, int32_t Delta)
+{
+    uint32_t Value = ((uint32_t)Delta << 1) ^ (uint32_t)(Delta >> 31);
+
+    int Length = 0;
+    while (Length < 32 && (Value >> Length) != 0) {
+        ++Length;
+    }
+
+    int Node = 1;
+    for (int i = 5; i >= 0; --i) {
+        uint32_t Bit = (Length >> i) & 1;
+        EncodeBit(Encoder, Model->Length + Node, Bit);
+        Node = (Node << 1) | Bit;
+    }
+
+    if (Length >= 2) {
+        EncodeBit(Encoder, Model->High + Length, (Value >> (Length - 2)) & 1);
+        EncodeDirectBits(Encoder, Value, Length - 2);
+    }
+}
+
+static int32_t
+DecodeValue(range_decoder *Decoder, value_model *Model)
+{
+    int Node = 1;
+    for (int i = 0; i < 6; ++i) {
+        Node = (Node << 1) | DecodeBit(Decoder, Model->Length + Node);
+    }
+    int Length = Node - 64;
+
+    uint32_t Value = Length ? 1 : 0;
+    if (Length > 32) {
+        Decoder->Overrun = true;
+    } else if (Length >= 2) {
+        Value = (Value << 1) | DecodeBit(Decoder, Model->High + Length);
+        uint32_t Low = DecodeDirectBits(Decoder, Length - 2);
+        Value = (Length > 2) ? ((Value << (Length - 2)) | Low) : Value;
+    }
+
+    return (int32_t)(Value >> 1) ^ -(int32_t)(Value & 1);
+}
+
+static uint32_t
+GetExportFieldSize(uint32_t Fields)
+{
+    uint32_t Size = 0;
+    if (Fields & ExportField_P) Size += sizeof(v2);
+    if (Fields & ExportField_V) Size += sizeof(v2);
+    if (Fields & ExportField_Density) Size += sizeof(float);
+    return Size;
+}
+
+struct export_component {
+    // NOTE(said): In floats, into the raw payload layout.
+    int Offset;
+    int Stride;
+
+    float Min;
+    float Step;
+    int32_t MinValue;
+    int32_t MaxValue;
+};
+
+static int
+GetExportComponents(uint32_t Fields, int ParticleCount, export_quantization *Quantization, export_component *Components)
+{
+    int32_t PositionMax = (int32_t)((1u << Quantization->PositionBits) - 1);
+    int32_t Unbounded = 1 << 30;
+
+    int Count = 0;
+    int Offset = 0;
+    if (Fields & ExportField_P) {
+        Components[Count++] = {Offset + 0, 2, Quantization->Min.x, Quantization->PositionStep.x, 0, PositionMax};
+        Components[Count++] = {Offset + 1, 2, Quantization->Min.y, Quantization->PositionStep.y, 0, PositionMax};
+        Offset += 2 * ParticleCount;
+    }
+    if (Fields & ExportField_V) {
+        Components[Count++] = {Offset + 0, 2, 0.0f, Quantization->VelocityStep, -Unbounded, Unbounded};
+        Components[Count++] = {Offset + 1, 2, 0.0f, Quantization->VelocityStep, -Unbounded, Unbounded};
+        Offset += 2 * ParticleCount;
+    }
+    if (Fields & ExportField_Density) {
+        Components[Count++] = {Offset, 1, 0.0f, Quantization->DensityStep, -Unbounded, Unbounded};
+        Offset += ParticleCount;
+    }
+
+    return Count;
+}
+
+// NOTE(said): Positions get PositionBits of fixed point across the world,
+// velocity and density a fixed step each.
+static void
+SetExportQuantization(exporter *Exporter, sim_config *Config, int PositionBits, float VelocityStep, float DensityStep)
+{
+    v2 WorldSize = V2(Config->WorldWidth, Config->WorldHeight);
+
+    export_quantization *Quantization = &Exporter->Quantization;
+    Quantization->PositionBits = PositionBits;
+    Quantization->Min = -0.5f * WorldSize;
+    Quantization->PositionStep = WorldSize * (1.0f / (float)((1u << PositionBits) - 1));
+    Quantization->VelocityStep = VelocityStep;
+    Quantization->DensityStep = DensityStep;
+
+    Exporter->Encoding = ExportEncoding_QuantizedKey;
+}
+
+static void
+GrowPreviousValues(int32_t **Previous, int *Capacity, int Count)
+{
+    if (*Capacity < Count) {
+        *Capacity = Count;
+        for (int i = 0; i < EXPORT_MAX_COMPONENTS; ++i) {
+            Previous[i] = (int32_t *)realloc(Previous[i], Count * sizeof(int32_t));
+        }
+    }
+}
+
+static uint32_t
+EncodeQuantizedPayload(exporter *Exporter, export_component *Components, int ComponentCount, int ParticleCount,
+                       float *Values, bool KeyFrame, uint8_t *Out, uint32_t Capacity)
+{
+    memcpy(Out, &Exporter->Quantization, sizeof(export_quantization));
+
+    range_encoder Encoder;
+    InitRangeEncoder(&Encoder, Out + sizeof(export_quantization), Out + Capacity);
+
+    for (int ComponentIndex = 0; ComponentIndex < ComponentCount; ++ComponentIndex) {
+        export_component Component = Components[ComponentIndex];
+        int32_t *Previous = Exporter->Previous[ComponentIndex];
+
+        value_model Model;
+        InitValueModel(&Model);
+
+        float InvStep = 1.0f / Component.Step;
+        int32_t Last = 0;
+        for (int i = 0; i < ParticleCount; ++i) {
+            float Value = Values[Component.Offset + i * Component.Stride];
+            float Scaled = Clamp((float)Component.MinValue, (Value - Component.Min) * InvStep + 0.5f, (float)Component.MaxValue);
+            int32_t Quantized = (int32_t)floorf(Scaled);
+
+            int32_t Prediction = KeyFrame ? Last : Previous[i];
+            EncodeValue(&Encoder, &Model, (int32_t)((uint32_t)Quantized - (uint32_t)Prediction));
+
+            Previous[i] = Quantized;
+            Last = Quantized;
+        }
+    }
+    FlushRangeEncoder(&Encoder);
+
+    return (uint32_t)(Encoder.At - Out);
+}
+
+// NOTE(said): Writer thread. Sets the encoding and payload size in the
+// header and returns the payload.
+static uint8_t *
+EncodeQuantizedFrame(exporter *Exporter, export_frame_header *Header, uint8_t *Payload)
+{
+    int ParticleCount = Header->ParticleCount;
+
+    bool CanDelta = (Header->FrameIndex % EXPORT_KEY_FRAME_INTERVAL != 0 &&
+                     Exporter->PreviousCount == ParticleCount);
+
+    export_component Components[EXPORT_MAX_COMPONENTS];
+    int ComponentCount = GetExportComponents(Exporter->Fields, ParticleCount, &Exporter->Quantization, Components);
+
+    // NOTE(said): Worst case is a bit over 9 bytes a value. Room for a key
+    // and a delta version of the frame.
+    uint32_t Capacity = sizeof(export_quantization) + ComponentCount * ParticleCount * 10 + 16;
+    if (Exporter->EncodedCapacity < 2 * Capacity) {
+        Exporter->EncodedCapacity = 2 * Capacity;
+        Exporter->Encoded = (uint8_t *)realloc(Exporter->Encoded, 2 * Capacity);
+    }
+    GrowPreviousValues(Exporter->Previous, &Exporter->PreviousCapacity, ParticleCount);
+
+    uint8_t *Key = Exporter->Encoded;
+    uint8_t *Delta = Exporter->Encoded + Capacity;
+
+    // NOTE(said): Delta goes first, it reads the previous values that both
+    // versions then overwrite with the same thing.
+    uint32_t DeltaSize = 0;
+    if (CanDelta) {
+        DeltaSize = EncodeQuantizedPayload(Exporter, Components, ComponentCount, ParticleCount,
+                                           (float *)Payload, false, Delta, Capacity);
+    }
+    uint32_t KeySize = EncodeQuantizedPayload(Exporter, Components, ComponentCount, ParticleCount,
+                                              (float *)Payload, true, Key, Capacity);
+
+    Exporter->PreviousCount = ParticleCount;
+
+    // NOTE(said): Particles that change cells shift everybody after them in
+    // the sort, so index i is often not the same particle as last frame and
+    // the neighbour in the same frame predicts better. Keep the smaller one.
+    if (CanDelta && DeltaSize < KeySize) {
+        Header->Encoding = ExportEncoding_QuantizedDelta;
+        Header->PayloadSize = DeltaSize;
+        return Delta;
+    }
+
+    Header->Encoding = ExportEncoding_QuantizedKey;
+    Header->PayloadSize = KeySize;
+    return Key;
+}
+
+struct export_decoder {
+    // NOTE(said): Quantized values of the last frame decoded, delta frames
+    // only decode right after the frame before them.
+    bool HasPrevious;
+    uint32_t PreviousFrameIndex;
+    int PreviousCount;
+    int PreviousCapacity;
+    int32_t *Previous[EXPORT_MAX_COMPONENTS];
+};
+
+// NOTE(said): Decodes a payload into the raw layout, Out needs room for
+// ParticleCount * GetExportFieldSize(Fields) bytes. Fails on delta frames
+// that don't follow the last decoded frame, seek to a key frame instead.
+static bool
+DecodeExportFrame(export_decoder *Decoder, uint32_t Fields, export_frame_header *Header, uint8_t *Payload, float *Out)
+{
+    int ParticleCount = Header->ParticleCount;
+
+    if (Header->Encoding == ExportEncoding_Raw) {
+        if (Header->PayloadSize != ParticleCount * GetExportFieldSize(Fields)) {
+            return false;
+        }
+        memcpy(Out, Payload, Header->PayloadSize);
+        Decoder->HasPrevious = false;
+        return true;
+    }
+
+    bool KeyFrame = Header->Encoding == ExportEncoding_QuantizedKey;
+    if (!KeyFrame && (Header->Encoding != ExportEncoding_QuantizedDelta ||
+                      !Decoder->HasPrevious ||
+                      Decoder->PreviousFrameIndex + 1 != Header->FrameIndex ||
+                      Decoder->PreviousCount != ParticleCount)) {
+        return false;
+    }
+    if (Header->PayloadSize < sizeof(export_quantization)) {
+        return false;
+    }
+
+    export_quantization Quantization;
+    memcpy(&Quantization, Payload, sizeof(Quantization));
+    if (Quantization.PositionBits < 1 || Quantization.PositionBits > EXPORT_MAX_POSITION_BITS) {
+        return false;
+    }
+
+    export_component Components[EXPORT_MAX_COMPONENTS];
+    int ComponentCount = GetExportComponents(Fields, ParticleCount, &Quantization, Components);
+
+    GrowPreviousValues(Decoder->Previous, &Decoder->PreviousCapacity, ParticleCount);
+
+    range_decoder RangeDecoder;
+    InitRangeDecoder(&RangeDecoder, Payload + sizeof(export_quantization), Payload + Header->PayloadSize);
+
+    for (int ComponentIndex = 0; ComponentIndex < ComponentCount; ++ComponentIndex) {
+        export_component Component = Components[ComponentIndex];
+        int32_t *Previous = Decoder->Previous[ComponentIndex];
+
+        value_model Model;
+        InitValueModel(&Model);
+
+        int32_t Last = 0;
+        for (int i = 0; i < ParticleCount; ++i) {
+            int32_t Prediction = KeyFrame ? Last : Previous[i];
+            int32_t Quantized = (int32_t)((uint32_t)Prediction + (uint32_t)DecodeValue(&RangeDecoder, &Model));
+
+            Out[Component.Offset + i * Component.Stride] = Component.Min + (float)Quantized * Component.Step;
+
+            Previous[i] = Quantized;
+            Last = Quantized;
+        }
+    }
+
+    Decoder->HasPrevious = !RangeDecoder.Overrun;
+    Decoder->PreviousFrameIndex = Header->FrameIndex;
+    Decoder->PreviousCount = ParticleCount;
+
+    return !RangeDecoder.Overrun;
+}
+
+// NOTE(said): Comma separated list of p, v and density.
+static bool
+ParseExportFields(const char *Text, uint32_t *Fields)
+{
+    char Buffer[64];
+    snprintf(Buffer, sizeof(Buffer), "%s", Text);
+
+    *Fields = 0;
+    for (char *Name = strtok(Buffer, ","); Name; Name = strtok(0, ",")) {
+        if (strcmp(Name, "p") == 0) {
+            *Fields |= ExportField_P;
+        } else if (strcmp(Name, "v") == 0) {
+            *Fields |= ExportField_V;
+        } else if (strcmp(Name, "density") == 0) {
+            *Fields |= ExportField_Density;
+        } else {
+            printf("Unknown export field '%s', expected p, v or density\n", Name);
+            return false;
+        }
+    }
+
+    return *Fields != 0;
+}
+
+static int
+ExportWriterProc(void *Data)
+{
+    exporter *Exporter = (exporter *)Data;
+
+    while (true) {
+        SDL_LockMutex(Exporter->Mutex);
+        while (Exporter->Count == 0 && !Exporter->Stopping) {
+            SDL_CondWait(Exporter->NotEmpty, Exporter->Mutex);
+        }
+        if (Exporter->Count == 0) {
+            SDL_UnlockMutex(Exporter->Mutex);
+            break;
+        }
+        export_frame *Frame = Exporter->Frames + Exporter->ReadIndex;
+        SDL_UnlockMutex(Exporter->Mutex);
+
+        // NOTE(said): The frame is ours until it's popped below.
+        export_frame_header Header = Frame->Header;
+        uint8_t *Payload = Frame->Payload;
+        if (Exporter->Encoding != ExportEncoding_Raw) {
+            Payload = EncodeQuantizedFrame(Exporter, &Header, Frame->Payload);
+        }
+
+        bool Ok = (fwrite(&Header, sizeof(Header), 1, Exporter->File) == 1 &&
+                   fwrite(Payload, 1, Header.PayloadSize, Exporter->File) == Header.PayloadSize);
+
+        SDL_LockMutex(Exporter->Mutex);
+        Exporter->EncoderMemory = (Exporter->PreviousCapacity * EXPORT_MAX_COMPONENTS * sizeof(int32_t) +
+                                   Exporter->EncodedCapacity);
+        if (Ok) {
+            Exporter->RawBytes += sizeof(Header) + Frame->Header.PayloadSize;
+            Exporter->BytesWritten += sizeof(Header) + Header.PayloadSize;
+        } else {
+            Exporter->WriteFailed = true;
+        }
+        Exporter->ReadIndex = (Exporter->ReadIndex + 1) % EXPORT_QUEUE_SIZE;
+        --Exporter->Count;
+        SDL_CondSignal(Exporter->NotFull);
+        SDL_UnlockMutex(Exporter->Mutex);
+    }
+
+    return 0;
+}
+
+static bool
+OpenExporter(exporter *Exporter, const char *FileName, uint32_t Fields, sim_config *Config)
+{
+    *Exporter = {};
+
+    Exporter->File = fopen(FileName, "wb");
+    if (!Exporter->File) {
+        printf("Couldn't open '%s' for export\n", FileName);
+        return false;
+    }
+
+    // NOTE(said): Big stdio buffer, the writer thread is the only one
+    // touching the file and most frames are a few hundred KB anyway.
+    setvbuf(Exporter->File, 0, _IOFBF, 1 << 20);
+
+    export_file_header Header = {};
+    Header.Magic = EXPORT_MAGIC;
+    Header.Version = EXPORT_VERSION;
+    Header.Fields = Fields;
+
+    fwrite(&Header, sizeof(Header), 1, Exporter->File);
+    long ConfigStart = ftell(Exporter->File);
+    PrintSimConfig(Exporter->File, Config);
+    Header.ConfigSize = (uint32_t)(ftell(Exporter->File) - ConfigStart);
+
+    fseek(Exporter->File, 0, SEEK_SET);
+    fwrite(&Header, sizeof(Header), 1, Exporter->File);
+    fseek(Exporter->File, 0, SEEK_END);
+
+    Exporter->Fields = Fields;
+    Exporter->Mutex = SDL_CreateMutex();
+    Exporter->NotEmpty = SDL_CreateCond();
+    Exporter->NotFull = SDL_CreateCond();
+    Exporter->Thread = SDL_CreateThread(ExportWriterProc, "ExportWriter", Exporter);
+
+    printf("Exporting to '%s'\n", FileName);
+
+    return true;
+}
+
+// NOTE(said): Called from the sim thread. Only blocks when the writer is a
+// whole queue behind, dropping frames would defeat the point of the export.
+static void
+ExportFrame(exporter *Exporter, sim *Sim)
+{
+    SDL_LockMutex(Exporter->Mutex);
+    if (Exporter->Count == EXPORT_QUEUE_SIZE) {
+        ++Exporter->StallCount;
+        while (Exporter->Count == EXPORT_QUEUE_SIZE) {
+            SDL_CondWait(Exporter->NotFull, Exporter->Mutex);
+        }
+    }
+    export_frame *Frame = Exporter->Frames + (Exporter->ReadIndex + Exporter->Count) % EXPORT_QUEUE_SIZE;
+    SDL_UnlockMutex(Exporter->Mutex);
+
+    int ParticleCount = Sim->ParticleCount;
+    uint32_t PayloadSize = ParticleCount * GetExportFieldSize(Exporter->Fields);
+    if (Frame->PayloadCapacity < PayloadSize) {
+        Frame->PayloadCapacity = PayloadSize;
+        Frame->Payload = (uint8_t *)realloc(Frame->Payload, PayloadSize);
+    }
+
+    uint8_t *At = Frame->Payload;
+    if (Exporter->Fields & ExportField_P) {
+        v2 *P = (v2 *)At;
+        for (int i = 0; i < ParticleCount; ++i) {
+            P[i] = Sim->Particles[i].P;
+        }
+        At += ParticleCount * sizeof(v2);
+    }
+    if (Exporter->Fields & ExportField_V) {
+        v2 *V = (v2 *)At;
+        for (int i = 0; i < ParticleCount; ++i) {
+            V[i] = Sim->Particles[i].V;
+        }
+        At += ParticleCount * sizeof(v2);
+    }
+    if (Exporter->Fields & ExportField_Density) {
+        float *Density = (float *)At;
+        for (int i = 0; i < ParticleCount; ++i) {
+            Density[i] = Sim->Densities[i];
+        }
+        At += ParticleCount * sizeof(float);
+    }
+    assert(At == Frame->Payload + PayloadSize);
+
+    export_frame_header *Header = &Frame->Header;
+    Header->Magic = EXPORT_FRAME_MAGIC;
+    Header->FrameIndex = Exporter->FrameIndex++;
+    Header->StepIndex = Sim->StepIndex;
+    Header->Time = Sim->Time;
+    Header->Dt = Sim->LastDt;
+    Header->ParticleCount = ParticleCount;
+    Header->Encoding = ExportEncoding_Raw;
+    Header->PayloadSize = PayloadSize;
+
+    SDL_LockMutex(Exporter->Mutex);
+    ++Exporter->Count;
+    SDL_CondSignal(Exporter->NotEmpty);
+    SDL_UnlockMutex(Exporter->Mutex);
+}
+
+// NOTE(said): Sim thread only, it's the one that grows the frame payloads.
+static size_t
+GetExporterMemory(exporter *Exporter)
+{
+    SDL_LockMutex(Exporter->Mutex);
+    size_t Result = Exporter->EncoderMemory;
+    SDL_UnlockMutex(Exporter->Mutex);
+
+    for (int i = 0; i < EXPORT_QUEUE_SIZE; ++i) {
+        Result += Exporter->Frames[i].PayloadCapacity;
+    }
+
+    return Result;
+}
+
+static void
+CloseExporter(exporter *Exporter)
+{
+    SDL_LockMutex(Exporter->Mutex);
+    Exporter->Stopping = true;
+    SDL_CondSignal(Exporter->NotEmpty);
+    SDL_UnlockMutex(Exporter->Mutex);
+
+    SDL_WaitThread(Exporter->Thread, 0);
+
+    if (fclose(Exporter->File) != 0) {
+        Exporter->WriteFailed = true;
+    }
+
+    printf("Exported %u frames, %.1f MB (%.1f MB raw)%s, the sim waited on the writer %d times\n",
+           Exporter->FrameIndex, Exporter->BytesWritten / (1024.0 * 1024.0), Exporter->RawBytes / (1024.0 * 1024.0),
+           Exporter->WriteFailed ? " (with write errors)" : "", Exporter->StallCount);
+
+    for (int i = 0; i < EXPORT_QUEUE_SIZE; ++i) {
+        free(Exporter->Frames[i].Payload);
+    }
+    for (int i = 0; i < EXPORT_MAX_COMPONENTS; ++i) {
+        free(Exporter->Previous[i]);
+    }
+    free(Exporter->Encoded);
+    SDL_DestroyCond(Exporter->NotEmpty);
+    SDL_DestroyCond(Exporter->NotFull);
+    SDL_DestroyMutex(Exporter->Mutex);
+}
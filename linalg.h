@@ -6,6 +6,14 @@ Clamp(float Low, float Value, float High)
     return Value;
 }
 
+static int
+Clamp(int Low, int Value, int High)
+{
+    if (Value < Low) return Low;
+    if (Value > High) return High;
+    return Value;
+}
+
 struct v2 {
     float x;
     float y;
@@ -124,6 +132,20 @@ Length(v2 V)
     return Result;
 }
 
+static float
+InvSqrt(float X)
+{
+#if defined(__SSE__) || defined(_M_X64)
+    // NOTE(said): The hardware estimate is good to about 12 bits,
+    // one Newton-Raphson step brings it close to full float precision.
+    float Estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(X)));
+    float Result = Estimate * (1.5f - 0.5f * X * Estimate * Estimate);
+#else
+    float Result = 1.0f / sqrtf(X);
+#endif
+    return Result;
+}
+
 static v2
 Normalize(v2 V)
 {
@@ -1,8 +1,13 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
 #include <SDL.h>
 #include <SDL_opengl.h>
 
@@ -35,14 +40,8 @@ typedef void (APIENTRY *gl_uniform_1i)(GLint, GLint);
 typedef GLuint (APIENTRY *gl_create_shader)(GLenum);
 typedef GLuint (APIENTRY *gl_create_program)(void);
 typedef void (APIENTRY *gl_get_shaderiv)(GLuint, GLenum, GLint *);
-typedef void (APIENTRY *gl_dispatch_compute)(GLuint, GLuint, GLuint);
-typedef void (APIENTRY *gl_gen_framebuffers)(GLsizei, GLuint *);
-typedef void (APIENTRY *gl_bind_framebuffer)(GLenum, GLuint);
-typedef void (APIENTRY *gl_framebuffer_texture_2d)(GLenum, GLenum, GLuint, GLuint, GLint);
-typedef void (APIENTRY *gl_bind_image_texture)(GLuint, GLuint, GLint, GLboolean, GLint, GLenum, GLenum);
 typedef void (APIENTRY *gl_tex_storage_2d)(GLenum, GLsizei, GLenum, GLsizei, GLsizei);
 typedef void (APIENTRY *gl_tex_storage_3d)(GLenum, GLsizei, GLenum, GLsizei, GLsizei, GLsizei);
-typedef void (APIENTRY *gl_memory_barrier)(GLbitfield);
 typedef void (APIENTRY *gl_active_texture)(GLenum);
 typedef void (APIENTRY *gl_draw_arrays_instanced)(GLenum, GLint, GLsizei, GLsizei);
 typedef void (APIENTRY *gl_vertex_attrib_divisor)(GLuint, GLuint);
@@ -71,14 +70,8 @@ static gl_uniform_1f glUniform1f = 0;
 static gl_uniform_2f glUniform2f = 0;
 static gl_uniform_1i glUniform1i = 0;
 static gl_get_shaderiv glGetShaderiv = 0;
-static gl_dispatch_compute glDispatchCompute = 0;
-static gl_gen_framebuffers glGenFramebuffers = 0;
-static gl_bind_framebuffer glBindFramebuffer = 0;
-static gl_framebuffer_texture_2d glFramebufferTexture2D = 0;
-static gl_bind_image_texture glBindImageTexture = 0;
 static gl_tex_storage_2d glTexStorage2D = 0;
 static gl_tex_storage_3d glTexStorage3D = 0;
-static gl_memory_barrier glMemoryBarrier = 0;
 static gl_active_texture glActiveTexture = 0;
 static gl_draw_arrays_instanced glDrawArraysInstanced = 0;
 static gl_vertex_attrib_divisor glVertexAttribDivisor = 0;
@@ -110,14 +103,8 @@ LoadOpenGLFunctions()
     glUniform1i = (gl_uniform_1i) SDL_GL_GetProcAddress("glUniform1i");
     glUniformMatrix4fv = (gl_uniform_matrix_4fv) SDL_GL_GetProcAddress("glUniformMatrix4fv");
     glGetShaderiv = (gl_get_shaderiv)SDL_GL_GetProcAddress("glGetShaderiv");
-    glDispatchCompute = (gl_dispatch_compute)SDL_GL_GetProcAddress("glDispatchCompute");
-    glGenFramebuffers = (gl_gen_framebuffers)SDL_GL_GetProcAddress("glGenFramebuffers");
-    glBindFramebuffer = (gl_bind_framebuffer)SDL_GL_GetProcAddress("glBindFramebuffer");
-    glFramebufferTexture2D = (gl_framebuffer_texture_2d)SDL_GL_GetProcAddress("glFramebufferTexture2D");
-    glBindImageTexture = (gl_bind_image_texture)SDL_GL_GetProcAddress("glBindImageTexture");
     glTexStorage2D = (gl_tex_storage_2d)SDL_GL_GetProcAddress("glTexStorage2D");
     glTexStorage3D = (gl_tex_storage_3d)SDL_GL_GetProcAddress("glTexStorage3D");
-    glMemoryBarrier = (gl_memory_barrier)SDL_GL_GetProcAddress("glMemoryBarrier");
     glActiveTexture = (gl_active_texture)SDL_GL_GetProcAddress("glActiveTexture");
 	glDrawArraysInstanced = (gl_draw_arrays_instanced)SDL_GL_GetProcAddress("glDrawArraysInstanced");
 	glVertexAttribDivisor = (gl_vertex_attrib_divisor)SDL_GL_GetProcAddress("glVertexAttribDivisor");
@@ -137,17 +124,450 @@ uint64_t GlobalPerformaceFreq;
 
 #include "work_queue.h"
 #include "linalg.h"
+#include "memory.h"
+#include "kernel.h"
 #include "sim.h"
 #include "render.h"
 
 //#include "posix_work_queue.cpp"
 #include "sdl2_work_queue.cpp"
 #include "sim.cpp"
+#include "config.cpp"
+#include "checkpoint.cpp"
+#include "export.cpp"
+#include "replay.cpp"
 #include "render.cpp"
+#include "regression.cpp"
+#include "bench.cpp"
+
+// NOTE(said): Triple buffer between the sim thread and the render thread.
+// The sim always owns one snapshot to write into, the renderer owns one to
+// draw from, and the third one is handed back and forth with an atomic swap,
+// so neither side ever waits for the other.
+#define SNAPSHOT_FRESH_BIT 4
+
+struct snapshot_triple_buffer {
+    sim_snapshot Snapshots[3];
+    int WriteIndex;
+    int ReadIndex;
+    SDL_atomic_t Spare;
+};
+
+static void
+InitTripleBuffer(snapshot_triple_buffer *Buffer)
+{
+    Buffer->WriteIndex = 0;
+    Buffer->ReadIndex = 1;
+    SDL_AtomicSet(&Buffer->Spare, 2);
+}
+
+static sim_snapshot *
+GetWriteSnapshot(snapshot_triple_buffer *Buffer)
+{
+    return Buffer->Snapshots + Buffer->WriteIndex;
+}
+
+static void
+PublishSnapshot(snapshot_triple_buffer *Buffer)
+{
+    SDL_MemoryBarrierRelease();
+    int Old = SDL_AtomicSet(&Buffer->Spare, Buffer->WriteIndex | SNAPSHOT_FRESH_BIT);
+    Buffer->WriteIndex = Old & 3;
+}
+
+static sim_snapshot *
+AcquireSnapshot(snapshot_triple_buffer *Buffer)
+{
+    if (SDL_AtomicGet(&Buffer->Spare) & SNAPSHOT_FRESH_BIT) {
+        int Old = SDL_AtomicSet(&Buffer->Spare, Buffer->ReadIndex);
+        Buffer->ReadIndex = Old & 3;
+        SDL_MemoryBarrierAcquire();
+    }
+    return Buffer->Snapshots + Buffer->ReadIndex;
+}
+
+// NOTE(said): Upper bound on sim steps per loop iteration, so a slow
+// stretch doesn't snowball into ever longer catch-up batches.
+#define MAX_SUBSTEPS 8
+
+struct sim_input {
+    bool Pulling;
+    v2 PullPoint;
+
+    // NOTE(said): Simulated seconds per wall clock second, zero means
+    // step as fast as possible.
+    float TimeScale;
+};
+
+struct sim_thread {
+    sim *Sim;
+    snapshot_triple_buffer *Snapshots;
+
+    SDL_mutex *InputMutex;
+    sim_input Input;
+
+    SDL_atomic_t Running;
+
+    // NOTE(said): Null unless exporting. Zero interval exports every step.
+    exporter *Exporter;
+    float ExportInterval;
+    float NextExportTime;
+};
+
+static void
+ExportIfDue(sim_thread *Thread)
+{
+    sim *Sim = Thread->Sim;
+    if (Thread->Exporter && Sim->Time >= Thread->NextExportTime) {
+        ExportFrame(Thread->Exporter, Sim);
+
+        // NOTE(said): Stay on the interval grid, steps don't line up with it.
+        while (Thread->ExportInterval > 0.0f && Thread->NextExportTime <= Sim->Time) {
+            Thread->NextExportTime += Thread->ExportInterval;
+        }
+    }
+}
+
+static int
+SimThreadProc(void *Data)
+{
+    sim_thread *Thread = (sim_thread *)Data;
+    sim *Sim = Thread->Sim;
+
+    float Accumulator = 0.0f;
+    float RealTimeFactor = 0.0f;
+    uint64_t LastCounter = SDL_GetPerformanceCounter();
+
+    while (SDL_AtomicGet(&Thread->Running)) {
+        SDL_LockMutex(Thread->InputMutex);
+        sim_input Input = Thread->Input;
+        SDL_UnlockMutex(Thread->InputMutex);
+
+        Sim->Pulling = Input.Pulling;
+        Sim->PullPoint = Input.PullPoint;
+
+        uint64_t Counter = SDL_GetPerformanceCounter();
+        float Elapsed = (float)(Counter - LastCounter) / (float)GlobalPerformaceFreq;
+        LastCounter = Counter;
+
+        float SimTimeStart = Sim->Time;
+
+        int Substeps = 0;
+        if (Input.TimeScale > 0.0f) {
+            Accumulator += Elapsed * Input.TimeScale;
+            // NOTE(said): Sim->Dt can change every step when it's adaptive,
+            // so take off whatever the step actually used.
+            while (Accumulator >= Sim->Dt && Substeps < MAX_SUBSTEPS) {
+                TIMER_START(Timer_Sim);
+                Simulate(Sim);
+                TIMER_END(Timer_Sim);
+                ExportIfDue(Thread);
+
+                Accumulator -= Sim->LastDt;
+                ++Substeps;
+            }
+
+            // NOTE(said): We couldn't keep up, drop the backlog and
+            // let the real-time factor show it.
+            if (Accumulator >= Sim->Dt) {
+                Accumulator = fmodf(Accumulator, Sim->Dt);
+            }
+        } else {
+            TIMER_START(Timer_Sim);
+            Simulate(Sim);
+            TIMER_END(Timer_Sim);
+            ExportIfDue(Thread);
+
+            Accumulator = 0.0f;
+            ++Substeps;
+        }
+
+        if (Elapsed > 0.0f) {
+            float Factor = (Sim->Time - SimTimeStart) / Elapsed;
+            RealTimeFactor = 0.95f * RealTimeFactor + 0.05f * Factor;
+        }
+
+        if (Substeps > 0) {
+            sim_snapshot *Snapshot = GetWriteSnapshot(Thread->Snapshots);
+            CopySimSnapshot(Snapshot, Sim);
+
+            Snapshot->Lag = Accumulator;
+            Snapshot->TimeScale = Input.TimeScale;
+            Snapshot->RealTimeFactor = RealTimeFactor;
+            Snapshot->PublishCounter = SDL_GetPerformanceCounter();
+            Snapshot->Memory.Export = Thread->Exporter ? GetExporterMemory(Thread->Exporter) : 0;
+
+            PublishSnapshot(Thread->Snapshots);
+        } else {
+            SDL_Delay(1);
+        }
+    }
+
+    return 0;
+}
+
+// NOTE(said): Same render loop as a live run without the sim thread. The
+// playback clock follows the wall clock and picks the frame to show.
+static void
+RunReplay(SDL_Window *Window, replay *Replay)
+{
+    sim *Sim = &Replay->Sim;
+    int LastFrame = Replay->FrameCount - 1;
+
+    opengl OpenGL = {};
+    InitializeOpenGL(&OpenGL, Sim->HashGrid, Sim->ParticleCount, Sim->Particles);
+
+    sim_snapshot Snapshot = {};
+    CopySimSnapshot(&Snapshot, Sim);
+
+    bool Running = true;
+    bool RenderContour = false;
+    bool Paused = false;
+
+    float TimeScale = 1.0f;
+    float PlaybackTime = Replay->FrameTimes[0];
+    uint64_t LastCounter = SDL_GetPerformanceCounter();
+
+    while (Running) {
+        int Frame = Replay->CurrentFrame;
+        int SeekFrame = -1;
+        bool SaveField = false;
+        bool ReportMemory = false;
+
+        SDL_Event Event;
+        while (SDL_PollEvent(&Event)) {
+            if (Event.type == SDL_QUIT) {
+                Running = false;
+                break;
+            } else if (Event.type == SDL_KEYDOWN) {
+                SDL_Keycode Key = Event.key.keysym.sym;
+                if (Key == SDLK_f && Event.key.repeat == 0) {
+                    RenderContour = !RenderContour;
+                } else if (Key == SDLK_SPACE && Event.key.repeat == 0) {
+                    Paused = !Paused;
+                } else if (Key == SDLK_LEFT) {
+                    SeekFrame = Frame - 1;
+                    Paused = true;
+                } else if (Key == SDLK_RIGHT) {
+                    SeekFrame = Frame + 1;
+                    Paused = true;
+                } else if (Key == SDLK_PAGEUP) {
+                    SeekFrame = Frame - Replay->FrameCount / 10 - 1;
+                } else if (Key == SDLK_PAGEDOWN) {
+                    SeekFrame = Frame + Replay->FrameCount / 10 + 1;
+                } else if (Key == SDLK_HOME) {
+                    SeekFrame = 0;
+                } else if (Key == SDLK_END) {
+                    SeekFrame = LastFrame;
+                } else if (Key == SDLK_LEFTBRACKET) {
+                    TimeScale *= 0.5f;
+                } else if (Key == SDLK_RIGHTBRACKET) {
+                    TimeScale *= 2.0f;
+                } else if (Key == SDLK_d && Event.key.repeat == 0) {
+                    SaveField = true;
+                } else if (Key == SDLK_m && Event.key.repeat == 0) {
+                    ReportMemory = true;
+                }
+            }
+        }
+
+        uint64_t Counter = SDL_GetPerformanceCounter();
+        float Elapsed = (float)(Counter - LastCounter) / (float)GlobalPerformaceFreq;
+        LastCounter = Counter;
+
+        if (SeekFrame != -1) {
+            SeekFrame = Clamp(0, SeekFrame, LastFrame);
+            PlaybackTime = Replay->FrameTimes[SeekFrame];
+        } else if (!Paused) {
+            PlaybackTime += Elapsed * TimeScale;
+            if (PlaybackTime >= Replay->FrameTimes[LastFrame]) {
+                PlaybackTime = Replay->FrameTimes[LastFrame];
+                Paused = true;
+            }
+        }
+
+        int TargetFrame = (SeekFrame != -1) ? SeekFrame : FindReplayFrame(Replay, PlaybackTime);
+        if (TargetFrame != Replay->CurrentFrame && SeekReplay(Replay, TargetFrame)) {
+            CopySimSnapshot(&Snapshot, Sim);
+
+            char Title[128];
+            snprintf(Title, sizeof(Title), "fluid - replay frame %d/%d, t=%.3f",
+                     Replay->CurrentFrame, LastFrame, Sim->Time);
+            SDL_SetWindowTitle(Window, Title);
+        }
+
+        // NOTE(said): Frames are drawn where they were recorded, a full step
+        // of lag keeps the renderer from winding them back along V.
+        Snapshot.Lag = Snapshot.Dt;
+        Snapshot.TimeScale = TimeScale;
+        Snapshot.RealTimeFactor = Paused ? 0.0f : TimeScale;
+        Snapshot.PublishCounter = Counter;
+
+        if (SaveField) {
+            CPUEvaluateField(&Snapshot, &OpenGL);
+            if (DumpField(&OpenGL, "field.pfm")) {
+                printf("Wrote field.pfm at t=%g\n", Snapshot.Time);
+            }
+        }
+        if (ReportMemory) {
+            PrintMemoryReport(&Snapshot, &OpenGL, 1);
+        }
+
+        int ScreenWidth = 0, ScreenHeight = 0;
+        SDL_GetWindowSize(Window, &ScreenWidth, &ScreenHeight);
+
+        Render(&Snapshot, &OpenGL, ScreenWidth, ScreenHeight, RenderContour);
+
+        SDL_GL_SwapWindow(Window);
+    }
+}
+
+static void
+PrintUsage(char *Program)
+{
+    printf("Usage: %s [--config FILE] [--restore FILE] [--checkpoint FILE] [--checkpoint-interval SECONDS]\n", Program);
+    printf("       %*s [--export FILE] [--export-interval SECONDS] [--export-fields p,v,density]\n", (int)strlen(Program), "");
+    printf("       %*s [--export-quantize POSITION_BITS] [--export-velocity-step STEP] [--export-density-step STEP]\n", (int)strlen(Program), "");
+    printf("       %*s [--field-sequence FILE] [name=value ...]\n", (int)strlen(Program), "");
+    printf("       %s --write-golden FILE [--steps N] [--config FILE] [name=value ...]\n", Program);
+    printf("       %s --check-golden FILE\n", Program);
+    printf("       %s --bench STEPS [--config FILE] [name=value ...]\n", Program);
+    printf("       %s --replay FILE\n", Program);
+    printf("Options are applied in order, later ones override earlier ones.\n");
+    printf("A restored run uses the config stored in the checkpoint.\n");
+    printf("Export writes every step unless an interval in simulated seconds is given.\n");
+    printf("Quantized export keeps errors within half a step, positions are fixed point\n");
+    printf("across the world (16 bits is plenty), velocity and density steps default to %g and %g.\n",
+           EXPORT_DEFAULT_VELOCITY_STEP, EXPORT_DEFAULT_DENSITY_STEP);
+    printf("A field sequence stores the density field of every rendered frame.\n");
+    printf("Replay plays an export back: space pauses, left and right step, page up and\n");
+    printf("page down jump a tenth of the way, home and end go to either end.\n");
+    printf("Bench runs the scene once per huge_pages mode and compares step times and dTLB misses.\n");
+    printf("Press M while running to print the memory use of every part.\n");
+    printf("Defaults:\n");
+
+    sim_config Defaults = DefaultSimConfig();
+    PrintSimConfig(stdout, &Defaults);
+}
 
 int
 main(int argc, char **argv)
 {
+    sim_config Config = DefaultSimConfig();
+
+    char *WriteGoldenFile = 0;
+    char *CheckGoldenFile = 0;
+    // NOTE(said): The default scene is chaotic. Against an -O2 golden, an
+    // -O3 -march=native -ffp-contract=fast build is off by about 6e-6 after
+    // 3 steps, 4e-5 after 4 and already past the 1e-3 tolerance after 5.
+    // --check-golden runs as many steps as the file was written with.
+    int GoldenStepCount = 3;
+    int BenchStepCount = 0;
+
+    char *RestoreFile = 0;
+    char *CheckpointFile = (char *)"checkpoint.pbf";
+    float CheckpointInterval = 0.0f;
+    char *ExportFile = 0;
+    float ExportInterval = 0.0f;
+    uint32_t ExportFields = ExportField_P | ExportField_V | ExportField_Density;
+    int ExportPositionBits = 0;
+    float ExportVelocityStep = EXPORT_DEFAULT_VELOCITY_STEP;
+    float ExportDensityStep = EXPORT_DEFAULT_DENSITY_STEP;
+    char *FieldSequenceFile = 0;
+    char *ReplayFile = 0;
+
+    for (int ArgIndex = 1; ArgIndex < argc; ++ArgIndex) {
+        char *Arg = argv[ArgIndex];
+
+        if (strcmp(Arg, "--config") == 0 && ArgIndex + 1 < argc) {
+            if (!LoadSimConfigFile(&Config, argv[++ArgIndex])) {
+                return 1;
+            }
+        } else if (strcmp(Arg, "--write-golden") == 0 && ArgIndex + 1 < argc) {
+            WriteGoldenFile = argv[++ArgIndex];
+        } else if (strcmp(Arg, "--check-golden") == 0 && ArgIndex + 1 < argc) {
+            CheckGoldenFile = argv[++ArgIndex];
+        } else if (strcmp(Arg, "--bench") == 0 && ArgIndex + 1 < argc) {
+            BenchStepCount = atoi(argv[++ArgIndex]);
+        } else if (strcmp(Arg, "--steps") == 0 && ArgIndex + 1 < argc) {
+            GoldenStepCount = atoi(argv[++ArgIndex]);
+        } else if (strcmp(Arg, "--restore") == 0 && ArgIndex + 1 < argc) {
+            RestoreFile = argv[++ArgIndex];
+        } else if (strcmp(Arg, "--checkpoint") == 0 && ArgIndex + 1 < argc) {
+            CheckpointFile = argv[++ArgIndex];
+        } else if (strcmp(Arg, "--checkpoint-interval") == 0 && ArgIndex + 1 < argc) {
+            CheckpointInterval = (float)atof(argv[++ArgIndex]);
+        } else if (strcmp(Arg, "--export") == 0 && ArgIndex + 1 < argc) {
+            ExportFile = argv[++ArgIndex];
+        } else if (strcmp(Arg, "--export-interval") == 0 && ArgIndex + 1 < argc) {
+            ExportInterval = (float)atof(argv[++ArgIndex]);
+        } else if (strcmp(Arg, "--export-fields") == 0 && ArgIndex + 1 < argc) {
+            if (!ParseExportFields(argv[++ArgIndex], &ExportFields)) {
+                return 1;
+            }
+        } else if (strcmp(Arg, "--export-quantize") == 0 && ArgIndex + 1 < argc) {
+            ExportPositionBits = atoi(argv[++ArgIndex]);
+            if (ExportPositionBits < 1 || ExportPositionBits > EXPORT_MAX_POSITION_BITS) {
+                printf("--export-quantize takes 1 to %d position bits\n", EXPORT_MAX_POSITION_BITS);
+                return 1;
+            }
+        } else if (strcmp(Arg, "--export-velocity-step") == 0 && ArgIndex + 1 < argc) {
+            ExportVelocityStep = (float)atof(argv[++ArgIndex]);
+        } else if (strcmp(Arg, "--export-density-step") == 0 && ArgIndex + 1 < argc) {
+            ExportDensityStep = (float)atof(argv[++ArgIndex]);
+        } else if (strcmp(Arg, "--replay") == 0 && ArgIndex + 1 < argc) {
+            ReplayFile = argv[++ArgIndex];
+        } else if (strcmp(Arg, "--field-sequence") == 0 && ArgIndex + 1 < argc) {
+            FieldSequenceFile = argv[++ArgIndex];
+        } else if (strcmp(Arg, "--help") == 0) {
+            PrintUsage(argv[0]);
+            return 0;
+        } else if (!ParseSimConfigAssignment(&Config, Arg)) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!ValidateSimConfig(&Config)) {
+        return 1;
+    }
+
+    // NOTE(said): The sim thread works on its own queue, the render thread
+    // keeps a few workers for field evaluation so the two never share a queue.
+    // The sim and render threads also run work from their queues, so they
+    // count against the CPUs too.
+    int CPUCount = SDL_GetCPUCount();
+    int RenderWorkerCount = CPUCount / 4;
+    if (RenderWorkerCount < 1) {
+        RenderWorkerCount = 1;
+    }
+    int SimWorkerCount = CPUCount - 2 - RenderWorkerCount;
+    if (SimWorkerCount < 1) {
+        SimWorkerCount = 1;
+    }
+    InitQueue(&GlobalWorkQueue, SimWorkerCount);
+    InitQueue(&GlobalRenderQueue, RenderWorkerCount);
+
+    // NOTE(said): Golden runs are headless and always deterministic.
+    if (CheckGoldenFile) {
+        return CheckGolden(CheckGoldenFile) ? 0 : 1;
+    }
+    if (WriteGoldenFile) {
+        Config.Deterministic = 1;
+        return WriteGolden(WriteGoldenFile, &Config, GoldenStepCount) ? 0 : 1;
+    }
+    if (BenchStepCount > 0) {
+        return RunBench(&Config, BenchStepCount) ? 0 : 1;
+    }
+
+    replay Replay = {};
+    if (ReplayFile) {
+        if (!OpenReplay(&Replay, ReplayFile)) {
+            return 1;
+        }
+        Config = Replay.Sim.Config;
+    }
+
     SDL_Init(SDL_INIT_VIDEO);
 
     SDL_Window *Window = SDL_CreateWindow("fluid", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1024, 1024, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
@@ -171,19 +591,75 @@ main(int argc, char **argv)
 
     GlobalPerformaceFreq = SDL_GetPerformanceFrequency();
 
-    InitQueue(&GlobalWorkQueue);
+    if (ReplayFile) {
+        RunReplay(Window, &Replay);
+        SDL_Quit();
+        return 0;
+    }
 
     sim Sim = {};
-    InitSim(&Sim);
+    if (RestoreFile) {
+        if (!RestoreCheckpoint(&Sim, RestoreFile)) {
+            return 1;
+        }
+        Config = Sim.Config;
+    } else {
+        InitSim(&Sim, &Config);
+    }
 
     opengl OpenGL = {};
     InitializeOpenGL(&OpenGL, Sim.HashGrid, Sim.ParticleCount, Sim.Particles);
 
+    snapshot_triple_buffer Snapshots = {};
+    InitTripleBuffer(&Snapshots);
+    CopySimSnapshot(GetWriteSnapshot(&Snapshots), &Sim);
+    PublishSnapshot(&Snapshots);
+
+    sim_thread SimThread = {};
+    SimThread.Sim = &Sim;
+    SimThread.Snapshots = &Snapshots;
+    SimThread.InputMutex = SDL_CreateMutex();
+    SimThread.Input.TimeScale = 1.0f;
+    SDL_AtomicSet(&SimThread.Running, 1);
+
+    exporter Exporter = {};
+    if (ExportFile) {
+        if (!OpenExporter(&Exporter, ExportFile, ExportFields, &Sim.Config)) {
+            return 1;
+        }
+        if (ExportPositionBits) {
+            if (ExportVelocityStep <= 0.0f || ExportDensityStep <= 0.0f) {
+                printf("Export steps have to be positive\n");
+                return 1;
+            }
+            SetExportQuantization(&Exporter, &Sim.Config, ExportPositionBits, ExportVelocityStep, ExportDensityStep);
+        }
+        SimThread.Exporter = &Exporter;
+        SimThread.ExportInterval = ExportInterval;
+        SimThread.NextExportTime = Sim.Time;
+    }
+
+    SDL_Thread *SimThreadHandle = SDL_CreateThread(SimThreadProc, "SimThread", &SimThread);
+
     bool Running = true;
     bool RenderContour = false;
 
+    float TimeScale = 1.0f;
+    float PacedTimeScale = TimeScale;
+
+    checkpoint_writer CheckpointWriter = {};
+    float NextCheckpointTime = Sim.Time + CheckpointInterval;
+
+    field_sequence FieldSequence = {};
+    if (FieldSequenceFile && !OpenFieldSequence(&FieldSequence, FieldSequenceFile, &OpenGL, &Config)) {
+        FieldSequenceFile = 0;
+    }
+
     while (Running) {
         bool ToggleRender = false;
+        bool SaveCheckpoint = false;
+        bool SaveField = false;
+        bool ReportMemory = false;
 
         SDL_Event Event;
         while (SDL_PollEvent(&Event)) {
@@ -193,6 +669,23 @@ main(int argc, char **argv)
             } else if (Event.type == SDL_KEYDOWN) {
                 if (Event.key.keysym.sym == SDLK_f && Event.key.repeat == 0) {
                     ToggleRender = true; 
+                } else if (Event.key.keysym.sym == SDLK_LEFTBRACKET && TimeScale > 0.0f) {
+                    TimeScale *= 0.5f;
+                } else if (Event.key.keysym.sym == SDLK_RIGHTBRACKET && TimeScale > 0.0f) {
+                    TimeScale *= 2.0f;
+                } else if (Event.key.keysym.sym == SDLK_u && Event.key.repeat == 0) {
+                    if (TimeScale > 0.0f) {
+                        PacedTimeScale = TimeScale;
+                        TimeScale = 0.0f;
+                    } else {
+                        TimeScale = PacedTimeScale;
+                    }
+                } else if (Event.key.keysym.sym == SDLK_s && Event.key.repeat == 0) {
+                    SaveCheckpoint = true;
+                } else if (Event.key.keysym.sym == SDLK_d && Event.key.repeat == 0) {
+                    SaveField = true;
+                } else if (Event.key.keysym.sym == SDLK_m && Event.key.repeat == 0) {
+                    ReportMemory = true;
                 }
             }
         }
@@ -207,18 +700,53 @@ main(int argc, char **argv)
         int MouseX = 0;
         int MouseY = 0;
         int ButtonState = SDL_GetMouseState(&MouseX, &MouseY);
-        Sim.PullPoint = (V2(MouseX, MouseY) * V2(1.0f / ScreenWidth, 1.0f / ScreenHeight) - V2(0.5f)) * V2(WORLD_WIDTH, -WORLD_HEIGHT);
-        Sim.Pulling = ButtonState & SDL_BUTTON(SDL_BUTTON_LEFT);
 
-        TIMER_START(Timer_Sim);
-        Simulate(&Sim);
-        TIMER_END(Timer_Sim);
+        SDL_LockMutex(SimThread.InputMutex);
+        SimThread.Input.PullPoint = (V2(MouseX, MouseY) * V2(1.0f / ScreenWidth, 1.0f / ScreenHeight) - V2(0.5f)) * V2(Config.WorldWidth, -Config.WorldHeight);
+        SimThread.Input.Pulling = ButtonState & SDL_BUTTON(SDL_BUTTON_LEFT);
+        SimThread.Input.TimeScale = TimeScale;
+        SDL_UnlockMutex(SimThread.InputMutex);
+
+        sim_snapshot *Snapshot = AcquireSnapshot(&Snapshots);
 
-        Render(&Sim, &OpenGL, ScreenWidth, ScreenHeight, RenderContour);
+        if (CheckpointInterval > 0.0f && Snapshot->Time >= NextCheckpointTime) {
+            SaveCheckpoint = true;
+            NextCheckpointTime = Snapshot->Time + CheckpointInterval;
+        }
+        if (SaveCheckpoint) {
+            BeginCheckpointWrite(&CheckpointWriter, Snapshot, CheckpointFile);
+        }
+
+        // NOTE(said): The field is only on the GPU when rendering, so
+        // evaluate it on the CPU for dumps.
+        if (SaveField || FieldSequenceFile) {
+            CPUEvaluateField(Snapshot, &OpenGL);
+            if (SaveField && DumpField(&OpenGL, "field.pfm")) {
+                printf("Wrote field.pfm at t=%g\n", Snapshot->Time);
+            }
+            if (FieldSequenceFile) {
+                AppendFieldFrame(&FieldSequence, &OpenGL, Snapshot->Time);
+            }
+        }
+        if (ReportMemory) {
+            PrintMemoryReport(Snapshot, &OpenGL, ArrayCount(Snapshots.Snapshots));
+        }
+
+        Render(Snapshot, &OpenGL, ScreenWidth, ScreenHeight, RenderContour);
 
         SDL_GL_SwapWindow(Window);
     }
 
+    SDL_AtomicSet(&SimThread.Running, 0);
+    SDL_WaitThread(SimThreadHandle, 0);
+    WaitForCheckpointWriter(&CheckpointWriter);
+    if (ExportFile) {
+        CloseExporter(&Exporter);
+    }
+    if (FieldSequenceFile) {
+        CloseFieldSequence(&FieldSequence);
+    }
+
     SDL_Quit();
 
     return 0;
@@ -0,0 +1,357 @@
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// NOTE(said): How the big simulation arrays (particles, the grid table, the
+// step arena) get their memory. The neighbour gathers jump all over these,
+// and with 4K pages a million particles need far more TLB entries than the
+// core has. Transparent asks the kernel to back the range with 2M pages when
+// it can, explicit takes them from the reserved hugetlb pool and falls back
+// to transparent when the pool is empty. Only Linux does anything here.
+enum page_mode {
+    PageMode_Normal,
+    PageMode_Transparent,
+    PageMode_Explicit,
+};
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static uint8_t *
+AlignPointer(uint8_t *Pointer, size_t Alignment)
+{
+    uintptr_t Address = (uintptr_t)Pointer;
+    Address = (Address + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+    return (uint8_t *)Address;
+}
+
+// NOTE(said): Sits in front of every large allocation so it can be freed
+// without the caller keeping the size around. A cache line, so the arrays
+// behind it stay aligned.
+#define LARGE_ALLOCATION_HEADER_SIZE 64
+
+struct large_allocation_header {
+    size_t Size;
+
+    // NOTE(said): Zero when it came from malloc.
+    size_t MappedSize;
+    page_mode Mode;
+};
+
+// NOTE(said): Live kilobytes per mode the allocations actually got, only
+// for the benchmark report. Normal ones aren't counted. The sim and render
+// threads both allocate, so these are atomic, and kilobytes so an int holds
+// a couple of terabytes.
+struct page_stats {
+    SDL_atomic_t Kilobytes[PageMode_Explicit + 1];
+    SDL_atomic_t ExplicitFallbacks;
+};
+
+static page_stats GlobalPageStats;
+
+static int
+GetPageStatsKilobytes(size_t Size)
+{
+    int Result = (int)((Size + 1023) / 1024);
+    return Result;
+}
+
+static void *
+AllocateLarge(size_t Size, page_mode Mode)
+{
+    size_t TotalSize = Size + LARGE_ALLOCATION_HEADER_SIZE;
+    uint8_t *Base = 0;
+    size_t MappedSize = 0;
+
+    // NOTE(said): Anything under a huge page would waste more than it saves.
+    if (TotalSize < HUGE_PAGE_SIZE) {
+        Mode = PageMode_Normal;
+    }
+
+#if defined(__linux__)
+    size_t RoundedSize = (TotalSize + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+    if (Mode == PageMode_Explicit) {
+        void *Mapping = mmap(0, RoundedSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (Mapping != MAP_FAILED) {
+            Base = (uint8_t *)Mapping;
+            MappedSize = RoundedSize;
+        } else {
+            if (SDL_AtomicAdd(&GlobalPageStats.ExplicitFallbacks, 1) == 0) {
+                printf("No explicit huge pages left (see vm.nr_hugepages), using transparent ones\n");
+            }
+            Mode = PageMode_Transparent;
+        }
+    }
+
+    if (Mode == PageMode_Transparent) {
+        // NOTE(said): The kernel only uses a huge page for an aligned 2M
+        // range, so map one page extra and cut the ends off.
+        size_t OverSize = RoundedSize + HUGE_PAGE_SIZE;
+        void *Mapping = mmap(0, OverSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (Mapping != MAP_FAILED) {
+            uint8_t *Start = (uint8_t *)Mapping;
+            uint8_t *Aligned = AlignPointer(Start, HUGE_PAGE_SIZE);
+            uint8_t *End = Start + OverSize;
+            if (Aligned > Start) {
+                munmap(Start, Aligned - Start);
+            }
+            if (End > Aligned + RoundedSize) {
+                munmap(Aligned + RoundedSize, End - (Aligned + RoundedSize));
+            }
+
+            madvise(Aligned, RoundedSize, MADV_HUGEPAGE);
+
+            Base = Aligned;
+            MappedSize = RoundedSize;
+        }
+    }
+#endif
+
+    if (!Base) {
+        Mode = PageMode_Normal;
+        Base = (uint8_t *)malloc(TotalSize);
+    }
+
+    large_allocation_header *Header = (large_allocation_header *)Base;
+    Header->Size = TotalSize;
+    Header->MappedSize = MappedSize;
+    Header->Mode = Mode;
+    if (Mode != PageMode_Normal) {
+        SDL_AtomicAdd(&GlobalPageStats.Kilobytes[Mode], GetPageStatsKilobytes(TotalSize));
+    }
+
+    return Base + LARGE_ALLOCATION_HEADER_SIZE;
+}
+
+static void
+FreeLarge(void *Memory)
+{
+    if (!Memory) {
+        return;
+    }
+
+    uint8_t *Base = (uint8_t *)Memory - LARGE_ALLOCATION_HEADER_SIZE;
+    large_allocation_header *Header = (large_allocation_header *)Base;
+    if (Header->Mode != PageMode_Normal) {
+        SDL_AtomicAdd(&GlobalPageStats.Kilobytes[Header->Mode], -GetPageStatsKilobytes(Header->Size));
+    }
+
+#if !defined(_WIN32)
+    if (Header->MappedSize) {
+        munmap(Base, Header->MappedSize);
+        return;
+    }
+#endif
+
+    free(Base);
+}
+
+// NOTE(said): Private (copy on write) mapping, so writes through it (the sim
+// sorts restored particles in place) never go back to the file.
+static uint8_t *
+MapFile(const char *FileName, size_t *Size)
+{
+    uint8_t *Base = 0;
+    *Size = 0;
+
+#if defined(_WIN32)
+    HANDLE FileHandle = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL, 0);
+    if (FileHandle != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER FileSize;
+        if (GetFileSizeEx(FileHandle, &FileSize) && FileSize.QuadPart > 0) {
+            // NOTE(said): The view keeps the mapping alive, so both handles
+            // can go right away.
+            HANDLE Mapping = CreateFileMappingA(FileHandle, 0, PAGE_WRITECOPY, 0, 0, 0);
+            if (Mapping) {
+                void *View = MapViewOfFile(Mapping, FILE_MAP_COPY, 0, 0, 0);
+                if (View) {
+                    Base = (uint8_t *)View;
+                    *Size = (size_t)FileSize.QuadPart;
+                }
+                CloseHandle(Mapping);
+            }
+        }
+        CloseHandle(FileHandle);
+    }
+#else
+    int FileHandle = open(FileName, O_RDONLY);
+    if (FileHandle != -1) {
+        struct stat Stat;
+        if (fstat(FileHandle, &Stat) == 0 && Stat.st_size > 0) {
+            *Size = Stat.st_size;
+            void *Mapping = mmap(0, *Size, PROT_READ | PROT_WRITE, MAP_PRIVATE, FileHandle, 0);
+            if (Mapping != MAP_FAILED) {
+                Base = (uint8_t *)Mapping;
+            }
+        }
+        close(FileHandle);
+    }
+#endif
+
+    return Base;
+}
+
+static void
+UnmapFile(uint8_t *Base, size_t Size)
+{
+#if defined(_WIN32)
+    UnmapViewOfFile(Base);
+#else
+    munmap(Base, Size);
+#endif
+}
+
+// NOTE(said): Linear allocator for scratch memory. Everything pushed since
+// the last reset is freed together. A push that doesn't fit goes into an
+// overflow block, and the next reset grows the main block to cover it, so
+// once the sizes settle nothing in a step or frame goes to malloc.
+//
+// Every thread that needs scratch memory owns its own arena (the sim thread
+// one for the step, the render thread one for the frame), so there's no
+// locking.
+#define ARENA_MIN_BLOCK_SIZE (64 * 1024)
+#define ARENA_DEFAULT_ALIGNMENT 16
+
+struct memory_arena_block {
+    memory_arena_block *Next;
+    size_t Size;
+    size_t Used;
+};
+
+struct memory_arena {
+    uint8_t *Base;
+    size_t Size;
+    size_t Used;
+
+    memory_arena_block *Overflow;
+    size_t OverflowSize;
+
+    // NOTE(said): Largest the arena got between two resets.
+    size_t HighWater;
+
+    // NOTE(said): For the main block, overflow blocks are short lived.
+    page_mode PageMode;
+};
+
+struct temporary_memory {
+    memory_arena *Arena;
+    size_t Used;
+};
+
+static void *
+PushSize(memory_arena *Arena, size_t Size, size_t Alignment = ARENA_DEFAULT_ALIGNMENT)
+{
+    uint8_t *Result = 0;
+
+    if (Arena->Base) {
+        uint8_t *At = AlignPointer(Arena->Base + Arena->Used, Alignment);
+        if (At + Size <= Arena->Base + Arena->Size) {
+            Result = At;
+            Arena->Used = (At + Size) - Arena->Base;
+        }
+    }
+
+    if (!Result) {
+        memory_arena_block *Block = Arena->Overflow;
+        uint8_t *At = 0;
+        if (Block) {
+            At = AlignPointer((uint8_t *)(Block + 1) + Block->Used, Alignment);
+        }
+
+        if (!Block || At + Size > (uint8_t *)(Block + 1) + Block->Size) {
+            size_t BlockSize = Size + Alignment;
+            if (BlockSize < ARENA_MIN_BLOCK_SIZE) {
+                BlockSize = ARENA_MIN_BLOCK_SIZE;
+            }
+
+            Block = (memory_arena_block *)malloc(sizeof(memory_arena_block) + BlockSize);
+            Block->Next = Arena->Overflow;
+            Block->Size = BlockSize;
+            Block->Used = 0;
+            Arena->Overflow = Block;
+            Arena->OverflowSize += BlockSize;
+
+            At = AlignPointer((uint8_t *)(Block + 1), Alignment);
+        }
+
+        Result = At;
+        Block->Used = (At + Size) - (uint8_t *)(Block + 1);
+    }
+
+    size_t Total = Arena->Used + Arena->OverflowSize;
+    if (Arena->HighWater < Total) {
+        Arena->HighWater = Total;
+    }
+
+    return Result;
+}
+
+#define PushArray(Arena, Count, type) (type *)PushSize((Arena), (size_t)(Count) * sizeof(type))
+#define PushStruct(Arena, type) (type *)PushSize((Arena), sizeof(type))
+
+// NOTE(said): Grows the main block if the last round spilled, at least
+// doubling it so a slowly growing sim doesn't reallocate every step.
+static void
+ResetArena(memory_arena *Arena)
+{
+    if (Arena->Overflow) {
+        size_t NewSize = Arena->Size + Arena->OverflowSize;
+        if (NewSize < 2 * Arena->Size) {
+            NewSize = 2 * Arena->Size;
+        }
+
+        while (Arena->Overflow) {
+            memory_arena_block *Next = Arena->Overflow->Next;
+            free(Arena->Overflow);
+            Arena->Overflow = Next;
+        }
+        Arena->OverflowSize = 0;
+
+        FreeLarge(Arena->Base);
+        Arena->Base = (uint8_t *)AllocateLarge(NewSize, Arena->PageMode);
+        Arena->Size = NewSize;
+    }
+
+    Arena->Used = 0;
+}
+
+// NOTE(said): For scratch inside a function that may run outside of the
+// arena's usual reset point. Anything that spilled stays around until the
+// next reset.
+static temporary_memory
+BeginTemporaryMemory(memory_arena *Arena)
+{
+    temporary_memory Result;
+    Result.Arena = Arena;
+    Result.Used = Arena->Used;
+    return Result;
+}
+
+static void
+EndTemporaryMemory(temporary_memory Temp)
+{
+    assert(Temp.Arena->Used >= Temp.Used);
+    Temp.Arena->Used = Temp.Used;
+}
+
+static void
+FreeArena(memory_arena *Arena)
+{
+    while (Arena->Overflow) {
+        memory_arena_block *Next = Arena->Overflow->Next;
+        free(Arena->Overflow);
+        Arena->Overflow = Next;
+    }
+    FreeLarge(Arena->Base);
+
+    page_mode PageMode = Arena->PageMode;
+    *Arena = {};
+    Arena->PageMode = PageMode;
+}
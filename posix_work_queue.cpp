@@ -9,15 +9,19 @@ struct work_queue_entry {
 struct work_queue {
     work_queue_entry *Works;
     int Size;
+    int Capacity;
     volatile int Index;
     volatile int DoneCount;
 
     pthread_mutex_t Mutex;
     pthread_cond_t Cond;
+
+    int ThreadCount;
+    pthread_t ThreadHandles[MAX_THREAD_COUNT - 1];
 };
 
-pthread_t GlobalThreadHandles[MAX_THREAD_COUNT - 1];
 static work_queue GlobalWorkQueue;
+static work_queue GlobalRenderQueue;
 
 static bool
 RunWorkEntry(work_queue *Queue)
@@ -47,7 +51,7 @@ RunWorkEntry(work_queue *Queue)
 static void *
 WorkerThreadProc(void *Data)
 {
-    work_queue *Queue = &GlobalWorkQueue;
+    work_queue *Queue = (work_queue *)Data;
     
     while (true) {
         bool DidWork = RunWorkEntry(Queue);
@@ -60,40 +64,55 @@ WorkerThreadProc(void *Data)
 }
 
 static void
-InitQueue(work_queue *Queue)
+InitQueue(work_queue *Queue, int WorkerThreads)
 {
     pthread_mutex_init(&Queue->Mutex, 0);
     pthread_cond_init(&Queue->Cond, 0);
-    Queue->Works = (work_queue_entry *)malloc(512 * sizeof(work_queue_entry));
     Queue->Size = 0;
+    Queue->Capacity = 512;
+    Queue->Works = (work_queue_entry *)malloc(Queue->Capacity * sizeof(work_queue_entry));
     Queue->DoneCount = 0;
     Queue->Index = 0;
 
-    int WorkerThreads = sysconf(_SC_NPROCESSORS_CONF) - 1;
+    if (WorkerThreads < 0) {
+        WorkerThreads = 0;
+    }
     if (WorkerThreads > MAX_THREAD_COUNT - 1) {
         WorkerThreads = MAX_THREAD_COUNT - 1;
     }
     printf("Spawning %d worker threads...\n", WorkerThreads);
+    Queue->ThreadCount = WorkerThreads;
     for (int i = 0; i < WorkerThreads; ++i) {
-        pthread_create(&GlobalThreadHandles[i], 0, WorkerThreadProc, 0);
+        pthread_create(&Queue->ThreadHandles[i], 0, WorkerThreadProc, Queue);
     }
 }
 
+// NOTE(said): Workers that ran out of entries keep polling RunWorkEntry until
+// they go to sleep, and they check Index against Size under the lock. So Size
+// only changes under the lock too, after the entry it covers is filled in.
 static void
 ResetQueue(work_queue *Queue)
 {
+    pthread_mutex_lock(&Queue->Mutex);
     Queue->Index = 0;
     Queue->Size = 0;
     Queue->DoneCount = 0;
+    pthread_mutex_unlock(&Queue->Mutex);
 }
 
 static void
 AddEntry(work_queue *Queue, void *Work, work_queue_proc Proc)
 {
-    assert(Queue->Size < 512);
-    work_queue_entry *Entry = Queue->Works + Queue->Size++;
+    pthread_mutex_lock(&Queue->Mutex);
+    if (Queue->Size >= Queue->Capacity) {
+        Queue->Capacity = Queue->Capacity * 3 / 2;
+        Queue->Works = (work_queue_entry *)realloc(Queue->Works, Queue->Capacity * sizeof(work_queue_entry));
+    }
+    work_queue_entry *Entry = Queue->Works + Queue->Size;
     Entry->Data = Work;
     Entry->Proc = Proc;
+    Queue->Size = Queue->Size + 1;
+    pthread_mutex_unlock(&Queue->Mutex);
 }
 
 static void
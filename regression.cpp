@@ -0,0 +1,344 @@
+// NOTE(said): Headless golden runs. --write-golden runs the configured
+// scenario and stores the end state, --check-golden runs the scenario stored
+// in the file again and compares. Invariants are checked after every step.
+
+#define GOLDEN_MAGIC 0x444c4f47 // "GOLD"
+#define GOLDEN_VERSION 1
+
+// NOTE(said): Loose enough to survive a different compiler or FMA contraction
+// over a short run, tight enough that a change to the solver's math shows up.
+// Positions are in world units and densities relative. The field is compared
+// after clamping to one, it goes to infinity on top of a particle and only
+// the values around the contour threshold matter.
+#define GOLDEN_POSITION_TOLERANCE 1e-3f
+#define GOLDEN_DENSITY_TOLERANCE 1e-3f
+#define GOLDEN_FIELD_TOLERANCE 0.05f
+
+// NOTE(said): Mean compression after a solve, a healthy run stays well
+// under this even with the waves going.
+#define GOLDEN_MAX_DENSITY_ERROR 0.5f
+
+#define GOLDEN_FIELD_SIZE 200
+
+struct golden_header {
+    uint32_t Magic;
+    uint32_t Version;
+
+    // NOTE(said): The config is stored as text in the config file format,
+    // so goldens keep loading when options are added.
+    uint32_t ConfigSize;
+
+    int StepCount;
+    int ParticleCount;
+    int FieldW;
+    int FieldH;
+};
+
+struct golden_state {
+    int ParticleCount;
+    v2 *P;
+    float *Density;
+
+    int FieldW;
+    int FieldH;
+    float *Field;
+};
+
+static bool
+CheckSimInvariants(sim *Sim)
+{
+    sim_config *Config = &Sim->Config;
+
+    // NOTE(said): The position update clamps to exactly these bounds.
+    float Epsilon = 1e-4f;
+    float MaxX = Config->WorldWidth * 0.5f - Config->ParticleRadius + Epsilon;
+    float MaxY = Config->WorldHeight * 0.5f - Config->ParticleRadius + Epsilon;
+
+    for (int i = 0; i < Sim->ParticleCount; ++i) {
+        particle *P = Sim->Particles + i;
+
+        if (!isfinite(P->P.x) || !isfinite(P->P.y) || !isfinite(P->V.x) || !isfinite(P->V.y) ||
+            !isfinite(Sim->Densities[i]) || !isfinite(Sim->Pressures[i])) {
+            printf("Step %llu: particle %d is not finite\n", (unsigned long long)Sim->StepIndex, i);
+            return false;
+        }
+
+        if (fabsf(P->P.x) > MaxX || fabsf(P->P.y) > MaxY) {
+            printf("Step %llu: particle %d left the world at (%g, %g)\n",
+                   (unsigned long long)Sim->StepIndex, i, P->P.x, P->P.y);
+            return false;
+        }
+    }
+
+    if (Sim->Diagnostics.DensityError > GOLDEN_MAX_DENSITY_ERROR) {
+        printf("Step %llu: density error %g is over %g\n",
+               (unsigned long long)Sim->StepIndex, Sim->Diagnostics.DensityError, GOLDEN_MAX_DENSITY_ERROR);
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+RunGoldenScenario(sim_config *Config, int StepCount, golden_state *State)
+{
+    sim Sim = {};
+    InitSim(&Sim, Config);
+
+    for (int Step = 0; Step < StepCount; ++Step) {
+        Simulate(&Sim);
+        if (!CheckSimInvariants(&Sim)) {
+            return false;
+        }
+    }
+
+    State->ParticleCount = Sim.ParticleCount;
+    State->P = (v2 *)malloc(Sim.ParticleCount * sizeof(v2));
+    State->Density = (float *)malloc(Sim.ParticleCount * sizeof(float));
+    for (int i = 0; i < Sim.ParticleCount; ++i) {
+        State->P[i] = Sim.Particles[i].P;
+        State->Density[i] = Sim.Densities[i];
+    }
+
+    // NOTE(said): The same field the renderer contours, evaluated on the CPU.
+    sim_snapshot Snapshot = {};
+    CopySimSnapshot(&Snapshot, &Sim);
+
+    opengl FieldGrid = {};
+    FieldGrid.GridW = GOLDEN_FIELD_SIZE;
+    FieldGrid.GridH = GOLDEN_FIELD_SIZE;
+    FieldGrid.Field = (float *)malloc((FieldGrid.GridW + 1) * (FieldGrid.GridH + 1) * sizeof(float));
+    CPUEvaluateField(&Snapshot, &FieldGrid);
+
+    State->FieldW = FieldGrid.GridW;
+    State->FieldH = FieldGrid.GridH;
+    State->Field = FieldGrid.Field;
+
+    return true;
+}
+
+static bool
+WriteGolden(const char *FileName, sim_config *Config, int StepCount)
+{
+    golden_state State = {};
+    if (!RunGoldenScenario(Config, StepCount, &State)) {
+        printf("Invariants failed, not writing '%s'\n", FileName);
+        return false;
+    }
+
+    FILE *File = fopen(FileName, "wb");
+    if (!File) {
+        printf("Couldn't open '%s' for writing\n", FileName);
+        return false;
+    }
+
+    golden_header Header = {};
+    Header.Magic = GOLDEN_MAGIC;
+    Header.Version = GOLDEN_VERSION;
+    Header.StepCount = StepCount;
+    Header.ParticleCount = State.ParticleCount;
+    Header.FieldW = State.FieldW;
+    Header.FieldH = State.FieldH;
+
+    // NOTE(said): Header goes in twice, the config size is only known
+    // after the config has been printed.
+    fwrite(&Header, sizeof(Header), 1, File);
+    long ConfigStart = ftell(File);
+    PrintSimConfig(File, Config);
+    Header.ConfigSize = (uint32_t)(ftell(File) - ConfigStart);
+
+    fwrite(State.P, sizeof(v2), State.ParticleCount, File);
+    fwrite(State.Density, sizeof(float), State.ParticleCount, File);
+    fwrite(State.Field, sizeof(float), (State.FieldW + 1) * (State.FieldH + 1), File);
+
+    fseek(File, 0, SEEK_SET);
+    fwrite(&Header, sizeof(Header), 1, File);
+
+    bool Result = !ferror(File);
+    fclose(File);
+
+    if (Result) {
+        printf("Wrote %d steps of %d particles to '%s'\n", StepCount, State.ParticleCount, FileName);
+    } else {
+        printf("Couldn't write '%s'\n", FileName);
+    }
+
+    return Result;
+}
+
+static float
+RelativeError(float Value, float Expected)
+{
+    float Result = fabsf(Value - Expected) / fmaxf(fabsf(Expected), 1e-6f);
+    return Result;
+}
+
+// NOTE(said): Particles are re-sorted every step, so after the smallest change
+// the same index can be a different particle. Instead every particle is
+// compared with the nearest one of the other run, looked up through a grid
+// built the same way the solver builds its own. Densities come back in the
+// sorted order.
+static particle *
+BuildMatchGrid(golden_state *State, sim_config *Config, hash_grid *Grid, float **Densities)
+{
+    *Grid = {};
+    Grid->WorldP = V2(Config->WorldWidth, Config->WorldHeight) * -0.5f;
+    Grid->CellDim = Config->H;
+    Grid->InvCellDim = 1.0f / Grid->CellDim;
+    Grid->Order = Config->GridOrder;
+    ResizeHashTable(Grid, 10);
+
+    particle *Particles = (particle *)calloc(State->ParticleCount, sizeof(particle));
+    for (int i = 0; i < State->ParticleCount; ++i) {
+        Particles[i].P = State->P[i];
+        Particles[i].CellKey = GetCellKey(*Grid, Particles[i].P);
+    }
+    int *SortedFrom = (int *)malloc(State->ParticleCount * sizeof(int));
+    memory_arena Arena = {};
+    ConstructSortedGrid(State->ParticleCount, Particles, Grid, &Arena, SortedFrom);
+    FreeArena(&Arena);
+
+    *Densities = (float *)malloc(State->ParticleCount * sizeof(float));
+    for (int i = 0; i < State->ParticleCount; ++i) {
+        (*Densities)[i] = State->Density[SortedFrom[i]];
+    }
+    free(SortedFrom);
+
+    return Particles;
+}
+
+static void
+CompareWithNearest(golden_state *State, hash_grid Grid, particle *Others, float *OtherDensities,
+                   float *MaxPositionError, float *MaxDensityError)
+{
+    for (int i = 0; i < State->ParticleCount; ++i) {
+        v2 P = State->P[i];
+
+        int CellX, CellY;
+        GetCellCoords(Grid, P, &CellX, &CellY);
+
+        particle_range Ranges[MAX_NEIGHBOR_RANGES];
+        int RangeCount = GetNeighborRanges(Grid, CellX, CellY, Ranges);
+
+        // NOTE(said): Nothing within a cell counts as a cell's worth of error.
+        // Particles pile up on top of each other against the walls, so the
+        // density is taken from the best match within tolerance, if any.
+        float NearestSq = Grid.CellDim * Grid.CellDim;
+        int Nearest = -1;
+        float DensityError = 1.0f;
+        bool HasMatch = false;
+        for (int RangeIndex = 0; RangeIndex < RangeCount; ++RangeIndex) {
+            for (int Other = Ranges[RangeIndex].Start; Other < Ranges[RangeIndex].End; ++Other) {
+                float DistanceSq = LengthSq(Others[Other].P - P);
+                if (DistanceSq <= GOLDEN_POSITION_TOLERANCE * GOLDEN_POSITION_TOLERANCE) {
+                    float Error = RelativeError(OtherDensities[Other], State->Density[i]);
+                    DensityError = HasMatch ? fminf(DensityError, Error) : Error;
+                    HasMatch = true;
+                }
+                if (DistanceSq < NearestSq) {
+                    NearestSq = DistanceSq;
+                    Nearest = Other;
+                }
+            }
+        }
+
+        if (!HasMatch && Nearest != -1) {
+            DensityError = RelativeError(OtherDensities[Nearest], State->Density[i]);
+        }
+
+        *MaxPositionError = fmaxf(*MaxPositionError, sqrtf(NearestSq));
+        *MaxDensityError = fmaxf(*MaxDensityError, DensityError);
+    }
+}
+
+static bool
+CheckGolden(const char *FileName)
+{
+    FILE *File = fopen(FileName, "rb");
+    if (!File) {
+        printf("Couldn't open golden file '%s'\n", FileName);
+        return false;
+    }
+
+    golden_header Header = {};
+    if (fread(&Header, sizeof(Header), 1, File) != 1 ||
+        Header.Magic != GOLDEN_MAGIC || Header.Version != GOLDEN_VERSION) {
+        printf("'%s' is not a version %d golden file\n", FileName, GOLDEN_VERSION);
+        fclose(File);
+        return false;
+    }
+
+    char *ConfigText = (char *)malloc(Header.ConfigSize + 1);
+    bool ReadOk = fread(ConfigText, 1, Header.ConfigSize, File) == Header.ConfigSize;
+    ConfigText[Header.ConfigSize] = 0;
+
+    golden_state Expected = {};
+    Expected.ParticleCount = Header.ParticleCount;
+    Expected.FieldW = Header.FieldW;
+    Expected.FieldH = Header.FieldH;
+
+    int FieldCount = (Header.FieldW + 1) * (Header.FieldH + 1);
+    Expected.P = (v2 *)malloc(Header.ParticleCount * sizeof(v2));
+    Expected.Density = (float *)malloc(Header.ParticleCount * sizeof(float));
+    Expected.Field = (float *)malloc(FieldCount * sizeof(float));
+
+    ReadOk = ReadOk && fread(Expected.P, sizeof(v2), Header.ParticleCount, File) == (size_t)Header.ParticleCount;
+    ReadOk = ReadOk && fread(Expected.Density, sizeof(float), Header.ParticleCount, File) == (size_t)Header.ParticleCount;
+    ReadOk = ReadOk && fread(Expected.Field, sizeof(float), FieldCount, File) == (size_t)FieldCount;
+    fclose(File);
+
+    if (!ReadOk) {
+        printf("'%s' is truncated\n", FileName);
+        return false;
+    }
+
+    // NOTE(said): Options the file doesn't mention keep their defaults.
+    sim_config Config = DefaultSimConfig();
+    if (!ParseSimConfigText(&Config, ConfigText) || !ValidateSimConfig(&Config)) {
+        return false;
+    }
+
+    golden_state Actual = {};
+    if (!RunGoldenScenario(&Config, Header.StepCount, &Actual)) {
+        return false;
+    }
+
+    if (Actual.ParticleCount != Expected.ParticleCount ||
+        Actual.FieldW != Expected.FieldW || Actual.FieldH != Expected.FieldH) {
+        printf("Particle count or field size doesn't match the golden file\n");
+        return false;
+    }
+
+    // NOTE(said): Both ways round, so a particle missing from either run shows up.
+    float MaxPositionError = 0;
+    float MaxDensityError = 0;
+
+    hash_grid ExpectedGrid;
+    float *ExpectedDensities;
+    particle *ExpectedParticles = BuildMatchGrid(&Expected, &Config, &ExpectedGrid, &ExpectedDensities);
+    CompareWithNearest(&Actual, ExpectedGrid, ExpectedParticles, ExpectedDensities,
+                       &MaxPositionError, &MaxDensityError);
+
+    hash_grid ActualGrid;
+    float *ActualDensities;
+    particle *ActualParticles = BuildMatchGrid(&Actual, &Config, &ActualGrid, &ActualDensities);
+    CompareWithNearest(&Expected, ActualGrid, ActualParticles, ActualDensities,
+                       &MaxPositionError, &MaxDensityError);
+
+    float MaxFieldError = 0;
+    for (int i = 0; i < FieldCount; ++i) {
+        float Error = fabsf(fminf(Actual.Field[i], 1.0f) - fminf(Expected.Field[i], 1.0f));
+        MaxFieldError = fmaxf(MaxFieldError, Error);
+    }
+
+    bool Passed = (MaxPositionError <= GOLDEN_POSITION_TOLERANCE &&
+                   MaxDensityError <= GOLDEN_DENSITY_TOLERANCE &&
+                   MaxFieldError <= GOLDEN_FIELD_TOLERANCE);
+
+    printf("position error %g (tolerance %g)\n", MaxPositionError, GOLDEN_POSITION_TOLERANCE);
+    printf("density error %g (tolerance %g)\n", MaxDensityError, GOLDEN_DENSITY_TOLERANCE);
+    printf("field error %g (tolerance %g)\n", MaxFieldError, GOLDEN_FIELD_TOLERANCE);
+    printf("%s: %s\n", FileName, Passed ? "PASSED" : "FAILED");
+
+    return Passed;
+}
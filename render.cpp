@@ -42,19 +42,20 @@ static const char *ParticleVertexShaderCode = R"glsl(
 
 	layout(location = 0) in vec2 position;
 
+	uniform vec2 WorldScale;
+	uniform float ParticleRadius;
+
 	flat out vec2 pos;
 	flat out float radius;
 
 	void main()
 	{
-		float WorldScale = 1.0 / 10.0;
-		float ParticleRadius = 0.0125;
 
 		vec2 p = vec2(gl_VertexID % 2, gl_VertexID / 2) - 0.5;
 		p = 2.0 * ParticleRadius * p + position;
 
 		pos = position * 2.0 * WorldScale;
-		radius = 2.0 * WorldScale * ParticleRadius;
+		radius = 2.0 * WorldScale.x * ParticleRadius;
 
 		gl_Position = vec4(2.0 * WorldScale * p, 0.0, 1.0);
 	}
@@ -138,64 +139,6 @@ static const char *TextureFragShaderCode = R"glsl(
     }
 )glsl";
 
-static const char *ComputeShaderCode = R"glsl(
-    #version 310 es
-
-    precision mediump image2D;
-    precision mediump image3D;
-
-    layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
-
-    layout(r32f, binding = 0) uniform writeonly image2D Field;
-    layout(rgba32f, binding = 1) uniform readonly image2D HashGrid;
-
-    void main()
-    {
-        uvec2 Pixel = gl_WorkGroupID.xy;
-        uvec2 GridSize = gl_NumWorkGroups.xy;
-
-        // TODO(said): Add #defines or here
-        float WORLD_WIDTH = 10.0;
-        float WORLD_HEIGHT = 10.0;
-        vec2 WorldSize = vec2(WORLD_WIDTH, WORLD_HEIGHT);
-        float ParticleRadius = 0.0125;
-        float H = ParticleRadius * 12.0;
-        ivec2 HashGridSize = ivec2(WorldSize / H);
-        vec2 CellSize = WorldSize / vec2(GridSize);
-
-        vec2 P = -0.5f * WorldSize + vec2(Pixel) * CellSize;
-
-        float FieldValue = 0.0;
-
-        ivec2 CenterCell = ivec2((P + 0.5 * WorldSize) / H);
-
-        for (int Row = 0; Row < 3; ++Row) {
-            for (int Col = 0; Col < 3; ++Col) {
-                ivec2 Cell = CenterCell - ivec2(1) + ivec2(Col, Row);
-
-                bool IsInvalid = Cell.x < 0 || Cell.x >= HashGridSize.x || Cell.y < 0 || Cell.y >= HashGridSize.y;
-                if (IsInvalid) {
-                    continue;
-                }
-
-                for (int i = 0; i < 64; ++i) {
-                    vec4 ParticleP = imageLoad(HashGrid, ivec2(Cell.x + Cell.y * HashGridSize.x, i));
-                    if (ParticleP.a < 1.0) {
-                        break;
-                    }
-
-                    vec2 D = ParticleP.xy - P;
-                    float R = ParticleP.z;
-                    float DistSq = dot(D, D);
-                    FieldValue += (R * R) / DistSq;
-                }
-            }
-        }
-
-        imageStore(Field, ivec2(Pixel), vec4(FieldValue, 0, 0, 0));
-    }
-)glsl";
-
 #define AssertGLError() AssertGLError_(__FILE__, __LINE__)
 
 static void
@@ -356,7 +299,7 @@ InitializeOpenGL(opengl *OpenGL, hash_grid HashGrid, int ParticleCount, particle
 	glGenBuffers(1, &OpenGL->ParticleVBO);
 	glBindBuffer(GL_ARRAY_BUFFER, OpenGL->ParticleVBO);
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(particle), (const GLvoid *)offsetof(particle, P));
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(v2), 0);
     glEnableVertexAttribArray(0);
 	glVertexAttribDivisor(0, 1);
 
@@ -370,11 +313,6 @@ InitializeOpenGL(opengl *OpenGL, hash_grid HashGrid, int ParticleCount, particle
     OpenGL->GridH = 200;
     OpenGL->Field = (float *)malloc((OpenGL->GridW + 1) * (OpenGL->GridH + 1) * sizeof(float));
 
-    GLuint ComputeShader = CompileShader(GL_COMPUTE_SHADER, ComputeShaderCode);
-    OpenGL->ComputeShaderProgram = glCreateProgram();
-    glAttachShader(OpenGL->ComputeShaderProgram, ComputeShader);
-    LinkProgram(OpenGL->ComputeShaderProgram);
-
     GLuint TextVertShader = CompileShader(GL_VERTEX_SHADER, TextVertShaderCode);
     GLuint TextFragShader = CompileShader(GL_FRAGMENT_SHADER, TextFragShaderCode);
     OpenGL->TextProgram = glCreateProgram();
@@ -383,16 +321,8 @@ InitializeOpenGL(opengl *OpenGL, hash_grid HashGrid, int ParticleCount, particle
     LinkProgram(OpenGL->TextProgram);
 
     OpenGL->ResolutionUniform = glGetUniformLocation(OpenGL->TextProgram, "Resolution");
-
-    glGenTextures(1, &OpenGL->HashGridTexture);
-    glBindTexture(GL_TEXTURE_2D, OpenGL->HashGridTexture);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    // glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, HashGrid.Width * HashGrid.Height, HashGrid.ElementsPerCell);
-    // glBindImageTexture(1, OpenGL->HashGridTexture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    OpenGL->ParticleWorldScaleUniform = glGetUniformLocation(OpenGL->ParticleProgram, "WorldScale");
+    OpenGL->ParticleRadiusUniform = glGetUniformLocation(OpenGL->ParticleProgram, "ParticleRadius");
 
     glGenTextures(1, &OpenGL->FieldTexture);
     glBindTexture(GL_TEXTURE_2D, OpenGL->FieldTexture);
@@ -401,11 +331,6 @@ InitializeOpenGL(opengl *OpenGL, hash_grid HashGrid, int ParticleCount, particle
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, OpenGL->GridW + 1, OpenGL->GridH + 1);
-    glBindImageTexture(0, OpenGL->FieldTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
-
-    glGenFramebuffers(1, &OpenGL->FieldFramebuffer);
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, OpenGL->FieldFramebuffer);
-    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, OpenGL->FieldTexture, 0);
 
     OpenGL->Font = InitFontTexture(OpenGL);
 }
@@ -413,23 +338,26 @@ InitializeOpenGL(opengl *OpenGL, hash_grid HashGrid, int ParticleCount, particle
 static void
 PushVertex(opengl *OpenGL, v2 P, v2 UV = V2(0, 0))
 {
-    bool HasSpace = OpenGL->VertexSize < OpenGL->VertexCapacity;
-    //assert(HasSpace);
-    if (HasSpace) {
-        OpenGL->Vertices[OpenGL->VertexSize].P = P;
-        OpenGL->Vertices[OpenGL->VertexSize].UV = UV;
-        ++OpenGL->VertexSize;
+    // NOTE(said): The contour of a big fluid at a fine field resolution
+    // easily goes past the starting size.
+    if (OpenGL->VertexSize == OpenGL->VertexCapacity) {
+        OpenGL->VertexCapacity *= 2;
+        OpenGL->Vertices = (vertex *)realloc(OpenGL->Vertices, sizeof(vertex) * OpenGL->VertexCapacity);
     }
+
+    OpenGL->Vertices[OpenGL->VertexSize].P = P;
+    OpenGL->Vertices[OpenGL->VertexSize].UV = UV;
+    ++OpenGL->VertexSize;
 }
 
 static void
 PushLine(opengl *OpenGL, v2 P0, v2 P1)
 {
-    P0.x = 2 * P0.x / WORLD_WIDTH;
-    P0.y = 2 * P0.y / WORLD_HEIGHT;
+    P0.x = 2 * P0.x / OpenGL->WorldSize.x;
+    P0.y = 2 * P0.y / OpenGL->WorldSize.y;
 
-    P1.x = 2 * P1.x / WORLD_WIDTH;
-    P1.y = 2 * P1.y / WORLD_HEIGHT;
+    P1.x = 2 * P1.x / OpenGL->WorldSize.x;
+    P1.y = 2 * P1.y / OpenGL->WorldSize.y;
 
     PushVertex(OpenGL, P0);
     PushVertex(OpenGL, P1);
@@ -501,8 +429,14 @@ EvaluateFieldTile(void *Data)
     int XEnd = Work->XEnd;
     int YEnd = Work->YEnd;
 
-    float WorldW = WORLD_WIDTH;
-    float WorldH = WORLD_HEIGHT;
+    float WorldW = Work->WorldSize.x;
+    float WorldH = Work->WorldSize.y;
+    float R = Work->ParticleRadius;
+
+    particle_range Ranges[MAX_NEIGHBOR_RANGES];
+    int RangeCount = 0;
+    int RangesX = -1;
+    int RangesY = -1;
 
     for (int XIndex = XStart; XIndex < XEnd; ++XIndex) {
         for (int YIndex = YStart; YIndex < YEnd; ++YIndex) {
@@ -510,34 +444,27 @@ EvaluateFieldTile(void *Data)
             {
                 v2 P = -0.5f * V2(WorldW, WorldH) + V2(XIndex, YIndex) * V2(CellW, CellH);
 
-                hash_grid_cell CenterCell = GetCell(HashGrid, P);
-
-                for (int Row = 0; Row < 3; ++Row) {
-                    for (int Col = 0; Col < 3; ++Col) {
-                        int CellX = CenterCell.x - 1 + Col;
-                        int CellY = CenterCell.y - 1 + Row;
-                        if (!IsWithinBounds(HashGrid, CellX, CellY)) {
-                            continue;
-                        }
-
-                        hash_grid_cell Cell = GetCell(HashGrid, CellX, CellY);
+                int CellX, CellY;
+                GetCellCoords(HashGrid, P, &CellX, &CellY);
+                if (CellX != RangesX || CellY != RangesY) {
+                    RangeCount = GetNeighborRanges(HashGrid, CellX, CellY, Ranges);
+                    RangesX = CellX;
+                    RangesY = CellY;
+                }
 
-                        for (int ParticleIndex = Cell.ParticleIndex;
-                             ParticleIndex != -1 && Cell.Index == Particles[ParticleIndex].CellIndex;
-                             ++ParticleIndex)
-                        {
-                            particle Particle = Particles[ParticleIndex];
+                for (int RangeIndex = 0; RangeIndex < RangeCount; ++RangeIndex) {
+                    particle_range Range = Ranges[RangeIndex];
+                    for (int ParticleIndex = Range.Start; ParticleIndex < Range.End; ++ParticleIndex) {
+                        particle Particle = Particles[ParticleIndex];
 
-                            float x = Particle.P.x;
-                            float y = Particle.P.y;
-                            float R = PARTICLE_RADIUS;
+                        float x = Particle.P.x;
+                        float y = Particle.P.y;
 
-                            float dX = x - P.x;
-                            float dY = y - P.y;
-                            float R2 = dX*dX + dY*dY;
+                        float dX = x - P.x;
+                        float dY = y - P.y;
+                        float R2 = dX*dX + dY*dY;
 
-                            FieldValue += R * R / R2;
-                        }
+                        FieldValue += R * R / R2;
                     }
                 }
             }
@@ -547,14 +474,14 @@ EvaluateFieldTile(void *Data)
 }
 
 static void
-CPUEvaluateField(sim *Sim, opengl *OpenGL)
+CPUEvaluateField(sim_snapshot *Snapshot, opengl *OpenGL)
 {
-    hash_grid HashGrid = Sim->HashGrid;
-    int ParticleCount = Sim->ParticleCount;
-    particle *Particles = Sim->Particles;
+    hash_grid HashGrid = Snapshot->HashGrid;
+    int ParticleCount = Snapshot->ParticleCount;
+    particle *Particles = Snapshot->Particles;
 
-    float WorldW = WORLD_WIDTH;
-    float WorldH = WORLD_HEIGHT;
+    float WorldW = Snapshot->Config.WorldWidth;
+    float WorldH = Snapshot->Config.WorldHeight;
 
     int GridW = OpenGL->GridW;
     int GridH = OpenGL->GridH;
@@ -568,15 +495,16 @@ CPUEvaluateField(sim *Sim, opengl *OpenGL)
 
     int TileCount = TileCountX * TileCountY;
 
-    work_queue *Queue = &GlobalWorkQueue;
+    work_queue *Queue = &GlobalRenderQueue;
     ResetQueue(Queue);
 
-    field_eval_work Works[128];
+    temporary_memory Temp = BeginTemporaryMemory(&OpenGL->FrameArena);
+
+    field_eval_work *Works = PushArray(&OpenGL->FrameArena, TileCount, field_eval_work);
     int WorkCount = 0;
 
     for (int TileX = 0; TileX < TileCountX; ++TileX) {
         for (int TileY = 0; TileY < TileCountY; ++TileY) {
-            assert(WorkCount < 128);
             field_eval_work *Work = Works + WorkCount++;
 
             Work->HashGrid = HashGrid;
@@ -585,6 +513,8 @@ CPUEvaluateField(sim *Sim, opengl *OpenGL)
             Work->GridW = GridW;
             Work->Field = Field;
             Work->Particles = Particles;
+            Work->WorldSize = V2(WorldW, WorldH);
+            Work->ParticleRadius = Snapshot->Config.ParticleRadius;
 
             Work->XStart = TileX * TileSize;
             Work->YStart = TileY * TileSize;
@@ -600,57 +530,146 @@ CPUEvaluateField(sim *Sim, opengl *OpenGL)
     }
 
     FinishWork(Queue);
+
+    EndTemporaryMemory(Temp);
 }
 
 static void
-GPUEvaluateField(sim *Sim, opengl *OpenGL)
+PrintMemoryLine(const char *Name, size_t Bytes)
 {
-    hash_grid HashGrid = Sim->HashGrid;
+    printf("  %-12s %10.1f MB\n", Name, Bytes / (1024.0 * 1024.0));
+}
 
-    int GridW = OpenGL->GridW;
-    int GridH = OpenGL->GridH;
+// NOTE(said): Everything that scales with the particle count or the field
+// size. The GPU side isn't counted.
+static void
+PrintMemoryReport(sim_snapshot *Snapshot, opengl *OpenGL, int SnapshotCount)
+{
+    memory_usage *Memory = &Snapshot->Memory;
+
+    size_t Render = (OpenGL->FrameArena.Size + OpenGL->FrameArena.OverflowSize +
+                     OpenGL->VertexCapacity * sizeof(vertex) +
+                     (OpenGL->GridW + 1) * (OpenGL->GridH + 1) * sizeof(float));
+    size_t Snapshots = SnapshotCount * Memory->Snapshot;
+    size_t Total = (Memory->Particles + Memory->HashGrid + Memory->StepArena +
+                    Snapshots + Render + Memory->Export);
+
+    printf("Memory for %d particles:\n", Snapshot->ParticleCount);
+    PrintMemoryLine("particles", Memory->Particles);
+    PrintMemoryLine("grid table", Memory->HashGrid);
+    PrintMemoryLine("step arena", Memory->StepArena);
+    printf("  %-12s %10.1f MB used at most\n", "", Memory->StepArenaHighWater / (1024.0 * 1024.0));
+    PrintMemoryLine("snapshots", Snapshots);
+    PrintMemoryLine("render", Render);
+    PrintMemoryLine("export", Memory->Export);
+    PrintMemoryLine("total", Total);
+}
+
+// NOTE(said): Little-endian PFM (scale is negative), which stores rows
+// bottom to top, same as the field.
+static bool
+DumpField(opengl *OpenGL, const char *FileName)
+{
+    FILE *File = fopen(FileName, "wb");
+    if (!File) {
+        printf("Couldn't open '%s' for writing\n", FileName);
+        return false;
+    }
+
+    int W = OpenGL->GridW + 1;
+    int H = OpenGL->GridH + 1;
+    fprintf(File, "Pf\n%d %d\n-1.0\n", W, H);
+    bool Result = fwrite(OpenGL->Field, sizeof(float) * W, H, File) == (size_t)H;
+    Result = (fclose(File) == 0) && Result;
 
-    glBindTexture(GL_TEXTURE_2D, OpenGL->HashGridTexture);
-    //glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, HashGrid.Width * HashGrid.Height, HashGrid.ElementsPerCell, GL_RGBA, GL_FLOAT, OpenGL->HashGridData);
+    if (!Result) {
+        printf("Couldn't write field to '%s'\n", FileName);
+    }
+
+    return Result;
+}
 
-    glUseProgram(OpenGL->ComputeShaderProgram);
-    glDispatchCompute(GridW + 1, GridH + 1, 1);
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+// NOTE(said): Sequence of fields in one file. Every frame is the same size,
+// so frame N starts at sizeof(field_sequence_header) + N * FrameSize.
+#define FIELD_SEQUENCE_MAGIC 0x46464250 // "PBFF"
+#define FIELD_SEQUENCE_VERSION 1
+
+struct field_sequence_header {
+    uint32_t Magic;
+    uint32_t Version;
+    int Width;
+    int Height;
+    v2 WorldSize;
+    uint32_t FrameSize;
+    uint32_t FrameCount;
+};
+
+struct field_frame_header {
+    uint32_t FrameIndex;
+    float Time;
+};
+
+struct field_sequence {
+    FILE *File;
+    field_sequence_header Header;
+};
+
+static bool
+OpenFieldSequence(field_sequence *Sequence, const char *FileName, opengl *OpenGL, sim_config *Config)
+{
+    *Sequence = {};
+
+    Sequence->File = fopen(FileName, "wb");
+    if (!Sequence->File) {
+        printf("Couldn't open '%s' for writing\n", FileName);
+        return false;
+    }
 
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, OpenGL->FieldFramebuffer);
-    glReadPixels(0, 0, GridW + 1, GridH + 1, GL_RED, GL_FLOAT, OpenGL->Field);
+    field_sequence_header *Header = &Sequence->Header;
+    Header->Magic = FIELD_SEQUENCE_MAGIC;
+    Header->Version = FIELD_SEQUENCE_VERSION;
+    Header->Width = OpenGL->GridW + 1;
+    Header->Height = OpenGL->GridH + 1;
+    Header->WorldSize = V2(Config->WorldWidth, Config->WorldHeight);
+    Header->FrameSize = sizeof(field_frame_header) + Header->Width * Header->Height * sizeof(float);
+
+    fwrite(Header, sizeof(*Header), 1, Sequence->File);
+
+    return true;
 }
 
 static void
-DumpField(opengl *OpenGL, const char *FileName)
+AppendFieldFrame(field_sequence *Sequence, opengl *OpenGL, float Time)
 {
-    FILE *File = fopen(FileName, "w");
-    fprintf(File, "P2\n");
-    fprintf(File, "%u %u\n", OpenGL->GridW+1, OpenGL->GridH+1);
-    fprintf(File, "255\n");
-    for (int i = 0; i < (OpenGL->GridW+1)*(OpenGL->GridH+1); ++i) {
-        uint32_t F = OpenGL->Field[i] * 255.0f;
-        fprintf(File, "%u\n", F);
-    }
-    fclose(File);
+    field_sequence_header *Header = &Sequence->Header;
+
+    field_frame_header Frame = {};
+    Frame.FrameIndex = Header->FrameCount++;
+    Frame.Time = Time;
+
+    fwrite(&Frame, sizeof(Frame), 1, Sequence->File);
+    fwrite(OpenGL->Field, sizeof(float), Header->Width * Header->Height, Sequence->File);
 }
 
 static void
-RenderMarchingSquares(opengl *OpenGL, sim *Sim, bool RenderContour)
+CloseFieldSequence(field_sequence *Sequence)
 {
-    hash_grid HashGrid = Sim->HashGrid;
-    int ParticleCount = Sim->ParticleCount;
-    particle *Particles = Sim->Particles;
+    // NOTE(said): Frame count goes in last, a reader can also get it from
+    // the file size if we never got here.
+    fseek(Sequence->File, 0, SEEK_SET);
+    fwrite(&Sequence->Header, sizeof(Sequence->Header), 1, Sequence->File);
 
-    for (int ParticleIndex = 0; ParticleIndex < ParticleCount; ++ParticleIndex) {
-        particle Particle = Particles[ParticleIndex];
-        Particle.CellIndex = GetCellIndex(HashGrid, Particle.P);
-    }
+    bool Ok = !ferror(Sequence->File);
+    Ok = (fclose(Sequence->File) == 0) && Ok;
 
-    ConstructSortedGrid(ParticleCount, Particles, HashGrid);
+    printf("Wrote %u field frames%s\n", Sequence->Header.FrameCount, Ok ? "" : " (with write errors)");
+}
 
-    float WorldW = WORLD_WIDTH;
-    float WorldH = WORLD_HEIGHT;
+static void
+RenderMarchingSquares(opengl *OpenGL, sim_snapshot *Snapshot, bool RenderContour)
+{
+    float WorldW = Snapshot->Config.WorldWidth;
+    float WorldH = Snapshot->Config.WorldHeight;
 
     float Threshold = 0.2f;
 
@@ -661,7 +680,7 @@ RenderMarchingSquares(opengl *OpenGL, sim *Sim, bool RenderContour)
     float *Field = OpenGL->Field;
 
     TIMER_START(Timer_RenderFieldEval);
-    CPUEvaluateField(Sim, OpenGL);
+    CPUEvaluateField(Snapshot, OpenGL);
     TIMER_END(Timer_RenderFieldEval);
 
     if (RenderContour) {
@@ -843,8 +862,21 @@ RenderMarchingSquares(opengl *OpenGL, sim *Sim, bool RenderContour)
     }
 }
 
+static float
+GetInterpolationAlpha(sim_snapshot *Snapshot)
+{
+    // NOTE(said): Unpaced runs just show the latest state.
+    if (Snapshot->TimeScale <= 0.0f || Snapshot->Dt <= 0.0f) {
+        return 1.0f;
+    }
+
+    float SincePublish = (float)(SDL_GetPerformanceCounter() - Snapshot->PublishCounter) / (float)GlobalPerformaceFreq;
+    float Alpha = (Snapshot->Lag + SincePublish * Snapshot->TimeScale) / Snapshot->Dt;
+    return Clamp(0.0f, Alpha, 1.0f);
+}
+
 static void
-RenderParticles(opengl *OpenGL, sim *Sim)
+RenderParticles(opengl *OpenGL, sim_snapshot *Snapshot)
 {
 	vertex Verts[6];
 
@@ -866,16 +898,33 @@ RenderParticles(opengl *OpenGL, sim *Sim)
 	Verts[5].P = V2(-1, -1);
 	Verts[5].UV = V2(0, 0);
 
+	v2 *ParticleP = PushArray(&OpenGL->FrameArena, Snapshot->ParticleCount, v2);
+
+	// NOTE(said): The snapshot is one step ahead of wall clock time,
+	// so draw somewhere between the start and the end of that step. The
+	// start is P - V * dt, which is off by a bit for particles that just
+	// bounced off a wall.
+	float Alpha = GetInterpolationAlpha(Snapshot);
+	float Back = (1.0f - Alpha) * Snapshot->Dt;
+	for (int i = 0; i < Snapshot->ParticleCount; ++i) {
+		particle *Particle = Snapshot->Particles + i;
+		ParticleP[i] = Particle->P - Back * Particle->V;
+	}
+
 	glBindBuffer(GL_ARRAY_BUFFER, OpenGL->ParticleVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(particle) * Sim->ParticleCount, Sim->Particles, GL_STREAM_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(v2) * Snapshot->ParticleCount, ParticleP, GL_STREAM_DRAW);
 
 	glUseProgram(OpenGL->ParticleProgram);
-	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, Sim->ParticleCount);
+	glUniform2f(OpenGL->ParticleWorldScaleUniform, 1.0f / Snapshot->Config.WorldWidth, 1.0f / Snapshot->Config.WorldHeight);
+	glUniform1f(OpenGL->ParticleRadiusUniform, Snapshot->Config.ParticleRadius);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, Snapshot->ParticleCount);
 }
 
 static void
-Render(sim *Sim, opengl *OpenGL, float Width, float Height, bool RenderContour)
+Render(sim_snapshot *Snapshot, opengl *OpenGL, float Width, float Height, bool RenderContour)
 {
+    ResetArena(&OpenGL->FrameArena);
+
     glViewport(0, 0, Width, Height);
 
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
@@ -883,10 +932,11 @@ Render(sim *Sim, opengl *OpenGL, float Width, float Height, bool RenderContour)
 
     float AspectRatio = (Width / Height);
 
-    particle *Particles = Sim->Particles;
+    particle *Particles = Snapshot->Particles;
 
-    float WorldW = WORLD_WIDTH;
-    float WorldH = WORLD_HEIGHT;
+    float WorldW = Snapshot->Config.WorldWidth;
+    float WorldH = Snapshot->Config.WorldHeight;
+    OpenGL->WorldSize = V2(WorldW, WorldH);
 
     float WorldAspectRatio = WorldW / WorldH;
 
@@ -929,15 +979,15 @@ Render(sim *Sim, opengl *OpenGL, float Width, float Height, bool RenderContour)
     GlUnitsPerMeter.x = GlW / WorldW;
     GlUnitsPerMeter.y = GlH / WorldH;
 
-    RenderParticles(OpenGL, Sim);
-    //RenderMarchingSquares(OpenGL, Sim, RenderContour);
+    RenderParticles(OpenGL, Snapshot);
+    //RenderMarchingSquares(OpenGL, Snapshot, RenderContour);
 
     OpenGL->VertexSize = 0;
 
     char Buffer[64];
     float PenY = 0;
 
-    sprintf(Buffer, "ParticleCount: %d", Sim->ParticleCount);
+    sprintf(Buffer, "ParticleCount: %d", Snapshot->ParticleCount);
     PushText(OpenGL, V2(0, PenY), Buffer);
     PenY += OpenGL->Font.PixelHeight;
 
@@ -949,11 +999,47 @@ Render(sim *Sim, opengl *OpenGL, float Width, float Height, bool RenderContour)
     PushText(OpenGL, V2(0, PenY), Buffer);
     PenY += OpenGL->Font.PixelHeight;
 
+    if (Snapshot->TimeScale > 0.0f) {
+        sprintf(Buffer, "Time scale: %gx", Snapshot->TimeScale);
+    } else {
+        sprintf(Buffer, "Time scale: unlimited");
+    }
+    PushText(OpenGL, V2(0, PenY), Buffer);
+    PenY += OpenGL->Font.PixelHeight;
+
+    sprintf(Buffer, "Real-time factor: %.2fx", Snapshot->RealTimeFactor);
+    PushText(OpenGL, V2(0, PenY), Buffer);
+    PenY += OpenGL->Font.PixelHeight;
+
+    sprintf(Buffer, "Step: %.2f ms", Snapshot->Dt * 1000.0f);
+    PushText(OpenGL, V2(0, PenY), Buffer);
+    PenY += OpenGL->Font.PixelHeight;
+
+    sim_diagnostics *Diagnostics = &Snapshot->Diagnostics;
+
+    sprintf(Buffer, "Density error: %.1f%% (max %.1f%%)",
+            100.0f * Diagnostics->DensityError, 100.0f * Diagnostics->MaxDensityError);
+    PushText(OpenGL, V2(0, PenY), Buffer);
+    PenY += OpenGL->Font.PixelHeight;
+
+    sprintf(Buffer, "Max speed: %.2f", Diagnostics->MaxSpeed);
+    PushText(OpenGL, V2(0, PenY), Buffer);
+    PenY += OpenGL->Font.PixelHeight;
+
     PenY += OpenGL->Font.PixelHeight;
 
     PushText(OpenGL, V2(0, PenY), "Press F to switch rendering mode");
     PenY += OpenGL->Font.PixelHeight;
 
+    PushText(OpenGL, V2(0, PenY), "Press [ and ] to change the time scale, U for unlimited");
+    PenY += OpenGL->Font.PixelHeight;
+
+    PushText(OpenGL, V2(0, PenY), "Press S to save a checkpoint, D to dump the field");
+    PenY += OpenGL->Font.PixelHeight;
+
+    PushText(OpenGL, V2(0, PenY), "Press M to print memory use");
+    PenY += OpenGL->Font.PixelHeight;
+
     glBindBuffer(GL_ARRAY_BUFFER, OpenGL->VBO);
     glBufferData(GL_ARRAY_BUFFER, OpenGL->VertexSize * sizeof(vertex), OpenGL->Vertices, GL_STREAM_DRAW);
 
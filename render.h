@@ -18,7 +18,6 @@ struct vertex {
 struct opengl {
     GLuint ShaderProgram;
     GLuint ParticleProgram;
-    GLuint ComputeShaderProgram;
     GLuint TextProgram;
     GLuint TextureProgram;
 
@@ -31,21 +30,26 @@ struct opengl {
     GLuint XScale;
     GLuint YScale;
 
-    GLuint FieldFramebuffer;
     GLuint FieldTexture;
-    GLuint HashGridTexture;
     GLuint FontTexture;
     GLuint ResolutionUniform;
+    GLuint ParticleWorldScaleUniform;
+    GLuint ParticleRadiusUniform;
+
+    v2 WorldSize;
 
     vertex *Vertices;
-    uint16_t VertexCapacity;
-    uint16_t VertexSize;
+    int VertexCapacity;
+    int VertexSize;
 
     int GridW;
     int GridH;
     float *Field;
 
     font_info Font;
+
+    // NOTE(said): Render thread scratch, reset at the start of Render.
+    memory_arena FrameArena;
 };
 
 struct field_eval_work {
@@ -56,6 +60,9 @@ struct field_eval_work {
     float *Field;
     particle *Particles;
 
+    v2 WorldSize;
+    float ParticleRadius;
+
     int XStart;
     int YStart;
     int XEnd;
@@ -0,0 +1,201 @@
+// NOTE(said): Plays back a file written by --export. The file is mapped and
+// indexed once, and a frame is decoded into a sim that never steps, so the
+// grid gets built the usual way and snapshots come out of CopySimSnapshot.
+struct replay {
+    uint8_t *Base;
+    size_t Size;
+
+    uint32_t Fields;
+    int FrameCount;
+    uint64_t *FrameOffsets;
+    float *FrameTimes;
+
+    int CurrentFrame;
+    export_decoder Decoder;
+    uint32_t ValueCapacity;
+    float *Values;
+
+    sim Sim;
+};
+
+static export_frame_header
+GetReplayFrameHeader(replay *Replay, int FrameIndex)
+{
+    // NOTE(said): The config text in front makes frames unaligned.
+    export_frame_header Header;
+    memcpy(&Header, Replay->Base + Replay->FrameOffsets[FrameIndex], sizeof(Header));
+    return Header;
+}
+
+static bool
+DecodeReplayFrame(replay *Replay, int FrameIndex)
+{
+    export_frame_header Header = GetReplayFrameHeader(Replay, FrameIndex);
+    uint8_t *Payload = Replay->Base + Replay->FrameOffsets[FrameIndex] + sizeof(Header);
+
+    uint32_t Size = Header.ParticleCount * GetExportFieldSize(Replay->Fields);
+    if (Replay->ValueCapacity < Size) {
+        Replay->ValueCapacity = Size;
+        Replay->Values = (float *)realloc(Replay->Values, Size);
+    }
+
+    return DecodeExportFrame(&Replay->Decoder, Replay->Fields, &Header, Payload, Replay->Values);
+}
+
+static bool
+SeekReplay(replay *Replay, int FrameIndex)
+{
+    FrameIndex = Clamp(0, FrameIndex, Replay->FrameCount - 1);
+    if (FrameIndex == Replay->CurrentFrame) {
+        return true;
+    }
+
+    // NOTE(said): Delta frames need the frame before them, so unless we're
+    // just stepping forward, start from the last key frame.
+    int StartFrame = FrameIndex;
+    if (FrameIndex != Replay->CurrentFrame + 1) {
+        while (StartFrame > 0 &&
+               GetReplayFrameHeader(Replay, StartFrame).Encoding == ExportEncoding_QuantizedDelta) {
+            --StartFrame;
+        }
+    }
+    for (int i = StartFrame; i <= FrameIndex; ++i) {
+        if (!DecodeReplayFrame(Replay, i)) {
+            printf("Couldn't decode frame %d\n", i);
+            return false;
+        }
+    }
+
+    export_frame_header Header = GetReplayFrameHeader(Replay, FrameIndex);
+    int ParticleCount = Header.ParticleCount;
+
+    sim *Sim = &Replay->Sim;
+    ReserveParticles(Sim, ParticleCount);
+    Sim->ParticleCount = ParticleCount;
+
+    float *Values = Replay->Values;
+    v2 *P = (v2 *)Values;
+    v2 *V = (Replay->Fields & ExportField_V) ? P + ParticleCount : 0;
+
+    for (int i = 0; i < ParticleCount; ++i) {
+        particle *Particle = Sim->Particles + i;
+        *Particle = {};
+        Particle->P = P[i];
+        Particle->V = V ? V[i] : V2(0);
+        Particle->CellKey = GetCellKey(Sim->HashGrid, Particle->P);
+    }
+    // NOTE(said): The replay sim never steps, so its step arena is free.
+    ResetArena(&Sim->StepArena);
+    ConstructSortedGrid(ParticleCount, Sim->Particles, &Sim->HashGrid, &Sim->StepArena);
+
+    Sim->Time = Header.Time;
+    Sim->LastDt = Header.Dt;
+    Sim->StepIndex = Header.StepIndex;
+
+    Replay->CurrentFrame = FrameIndex;
+
+    return true;
+}
+
+// NOTE(said): Last frame at or before Time.
+static int
+FindReplayFrame(replay *Replay, float Time)
+{
+    int Low = 0;
+    int High = Replay->FrameCount - 1;
+    while (Low < High) {
+        int Mid = (Low + High + 1) / 2;
+        if (Replay->FrameTimes[Mid] <= Time) {
+            Low = Mid;
+        } else {
+            High = Mid - 1;
+        }
+    }
+    return Low;
+}
+
+static bool
+OpenReplay(replay *Replay, const char *FileName)
+{
+    *Replay = {};
+
+    Replay->Base = MapFile(FileName, &Replay->Size);
+    if (!Replay->Base) {
+        printf("Couldn't read '%s'\n", FileName);
+        return false;
+    }
+
+    export_file_header Header = {};
+    if (Replay->Size >= sizeof(Header)) {
+        memcpy(&Header, Replay->Base, sizeof(Header));
+    }
+
+    bool Valid = (Header.Magic == EXPORT_MAGIC &&
+                  Header.Version == EXPORT_VERSION &&
+                  (Header.Fields & ExportField_P) &&
+                  sizeof(Header) + Header.ConfigSize <= Replay->Size);
+
+    sim_config Config = DefaultSimConfig();
+    if (Valid) {
+        char *ConfigText = (char *)malloc(Header.ConfigSize + 1);
+        memcpy(ConfigText, Replay->Base + sizeof(Header), Header.ConfigSize);
+        ConfigText[Header.ConfigSize] = 0;
+
+        Valid = ParseSimConfigText(&Config, ConfigText) && ValidateSimConfig(&Config);
+        free(ConfigText);
+    }
+
+    if (!Valid) {
+        printf("'%s' is not a version %d export with positions\n", FileName, EXPORT_VERSION);
+        UnmapFile(Replay->Base, Replay->Size);
+        return false;
+    }
+
+    Replay->Fields = Header.Fields;
+
+    // NOTE(said): Index the frames. A run that got killed leaves a partial
+    // frame at the end, stop at the first one that doesn't fit.
+    int FrameCapacity = 0;
+    uint64_t Offset = sizeof(Header) + Header.ConfigSize;
+    while (Offset + sizeof(export_frame_header) <= Replay->Size) {
+        export_frame_header FrameHeader;
+        memcpy(&FrameHeader, Replay->Base + Offset, sizeof(FrameHeader));
+
+        uint64_t End = Offset + sizeof(FrameHeader) + FrameHeader.PayloadSize;
+        if (FrameHeader.Magic != EXPORT_FRAME_MAGIC ||
+            FrameHeader.FrameIndex != (uint32_t)Replay->FrameCount ||
+            FrameHeader.ParticleCount < 0 ||
+            End > Replay->Size) {
+            break;
+        }
+
+        if (Replay->FrameCount == FrameCapacity) {
+            FrameCapacity = FrameCapacity ? 2 * FrameCapacity : 256;
+            Replay->FrameOffsets = (uint64_t *)realloc(Replay->FrameOffsets, FrameCapacity * sizeof(uint64_t));
+            Replay->FrameTimes = (float *)realloc(Replay->FrameTimes, FrameCapacity * sizeof(float));
+        }
+        Replay->FrameOffsets[Replay->FrameCount] = Offset;
+        Replay->FrameTimes[Replay->FrameCount] = FrameHeader.Time;
+        ++Replay->FrameCount;
+
+        Offset = End;
+    }
+
+    if (Replay->FrameCount == 0) {
+        printf("'%s' has no frames\n", FileName);
+        UnmapFile(Replay->Base, Replay->Size);
+        return false;
+    }
+
+    SetupSim(&Replay->Sim, &Config);
+
+    Replay->CurrentFrame = -1;
+    if (!SeekReplay(Replay, 0)) {
+        return false;
+    }
+
+    printf("Replaying %d frames (t=%g to %g) from '%s'\n", Replay->FrameCount,
+           Replay->FrameTimes[0], Replay->FrameTimes[Replay->FrameCount - 1], FileName);
+
+    return true;
+}
@@ -12,10 +12,13 @@ struct work_queue {
 
     SDL_mutex *Mutex;
     SDL_cond *Cond;
+
+    int ThreadCount;
+    SDL_Thread *ThreadHandles[MAX_THREAD_COUNT - 1];
 };
 
-SDL_Thread *GlobalThreadHandles[MAX_THREAD_COUNT - 1];
 static work_queue GlobalWorkQueue;
+static work_queue GlobalRenderQueue;
 
 static bool
 RunWorkEntry(work_queue *Queue)
@@ -45,7 +48,7 @@ RunWorkEntry(work_queue *Queue)
 static int
 WorkerThreadProc(void *Data)
 {
-    work_queue *Queue = &GlobalWorkQueue;
+    work_queue *Queue = (work_queue *)Data;
 
     while (true) {
         bool DidWork = RunWorkEntry(Queue);
@@ -60,7 +63,7 @@ WorkerThreadProc(void *Data)
 }
 
 static void
-InitQueue(work_queue *Queue)
+InitQueue(work_queue *Queue, int WorkerThreads)
 {
     Queue->Mutex = SDL_CreateMutex();
     Queue->Cond = SDL_CreateCond();
@@ -70,34 +73,45 @@ InitQueue(work_queue *Queue)
     Queue->DoneCount = 0;
     Queue->Index = 0;
 
-    int WorkerThreads = SDL_GetCPUCount() - 1;
+    if (WorkerThreads < 0) {
+        WorkerThreads = 0;
+    }
     if (WorkerThreads > MAX_THREAD_COUNT - 1) {
         WorkerThreads = MAX_THREAD_COUNT - 1;
     }
     printf("Spawning %d worker threads...\n", WorkerThreads);
+    Queue->ThreadCount = WorkerThreads;
     for (int i = 0; i < WorkerThreads; ++i) {
-        GlobalThreadHandles[i] = SDL_CreateThread(WorkerThreadProc, "WorkerThread", 0);
+        Queue->ThreadHandles[i] = SDL_CreateThread(WorkerThreadProc, "WorkerThread", Queue);
     }
 }
 
+// NOTE(said): Workers that ran out of entries keep polling RunWorkEntry until
+// they go to sleep, and they check Index against Size under the lock. So Size
+// only changes under the lock too, after the entry it covers is filled in.
 static void
 ResetQueue(work_queue *Queue)
 {
+    SDL_LockMutex(Queue->Mutex);
     Queue->Index = 0;
     Queue->Size = 0;
     Queue->DoneCount = 0;
+    SDL_UnlockMutex(Queue->Mutex);
 }
 
 static void
 AddEntry(work_queue *Queue, void *Work, work_queue_proc Proc)
 {
+    SDL_LockMutex(Queue->Mutex);
     if (Queue->Size >= Queue->Capacity) {
 		Queue->Capacity = Queue->Capacity * 3 / 2;
 		Queue->Works = (work_queue_entry *)realloc(Queue->Works, Queue->Capacity * sizeof(work_queue_entry));
 	}
-    work_queue_entry *Entry = Queue->Works + Queue->Size++;
+    work_queue_entry *Entry = Queue->Works + Queue->Size;
     Entry->Data = Work;
     Entry->Proc = Proc;
+    Queue->Size = Queue->Size + 1;
+    SDL_UnlockMutex(Queue->Mutex);
 }
 
 static void
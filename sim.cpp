@@ -1,34 +1,149 @@
-static int
-GetCellIndex(hash_grid Grid, int x, int y)
+static random_series
+RandomSeed(uint64_t Seed)
 {
-    int Index = x + y * Grid.Width;
-    return Index;
+    random_series Series = {};
+
+    // NOTE(said): xorshift never leaves zero, so scramble the seed first.
+    Series.State = Seed * 0x9E3779B97F4A7C15ull + 0x2545F4914F6CDD1Dull;
+    if (Series.State == 0) {
+        Series.State = 1;
+    }
+
+    return Series;
 }
 
-static int
-GetCellIndex(hash_grid Grid, v2 P)
+static uint32_t
+RandomNextU32(random_series *Series)
+{
+    uint64_t x = Series->State;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    Series->State = x;
+
+    uint32_t Result = (uint32_t)((x * 0x2545F4914F6CDD1Dull) >> 32);
+    return Result;
+}
+
+static float
+RandomUnilateral(random_series *Series)
+{
+    float Result = (float)(RandomNextU32(Series) >> 8) * (1.0f / 16777216.0f);
+    return Result;
+}
+
+static float
+RandomBilateral(random_series *Series)
+{
+    float Result = 2.0f * RandomUnilateral(Series) - 1.0f;
+    return Result;
+}
+
+static uint32_t
+SpreadBits(uint32_t x)
+{
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+static uint32_t
+CompactBits(uint32_t x)
+{
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0f0f0f0f;
+    x = (x | (x >> 4)) & 0x00ff00ff;
+    x = (x | (x >> 8)) & 0x0000ffff;
+    return x;
+}
+
+static uint32_t
+GetCellKey(hash_grid Grid, int x, int y)
+{
+    uint32_t Key = 0;
+    if (Grid.Order == GridOrder_Morton) {
+        Key = SpreadBits(x) | (SpreadBits(y) << 1);
+    } else {
+        Key = (uint32_t)x | ((uint32_t)y << 16);
+    }
+    return Key;
+}
+
+static void
+GetCellCoords(hash_grid Grid, v2 P, int *x, int *y)
 {
     P = P - Grid.WorldP;
 
-    int x = Clamp(0, (int)(P.x / Grid.CellDim), Grid.Width - 1);
-    int y = Clamp(0, (int)(P.y / Grid.CellDim), Grid.Height - 1);
+    // NOTE(said): Cells outside the world box get their own coordinates,
+    // only the (huge) key range is clamped.
+    *x = Clamp(0, (int)floorf(P.x * Grid.InvCellDim) + HASH_GRID_COORD_BIAS, HASH_GRID_MAX_COORD);
+    *y = Clamp(0, (int)floorf(P.y * Grid.InvCellDim) + HASH_GRID_COORD_BIAS, HASH_GRID_MAX_COORD);
+}
+
+static void
+GetCellCoords(hash_grid Grid, uint32_t Key, int *x, int *y)
+{
+    if (Grid.Order == GridOrder_Morton) {
+        *x = CompactBits(Key);
+        *y = CompactBits(Key >> 1);
+    } else {
+        *x = Key & 0xFFFF;
+        *y = Key >> 16;
+    }
+}
+
+static uint32_t
+GetCellKey(hash_grid Grid, v2 P)
+{
+    int x, y;
+    GetCellCoords(Grid, P, &x, &y);
+
+    uint32_t Key = GetCellKey(Grid, x, y);
+    assert(Key != HASH_GRID_EMPTY_KEY);
+
+    return Key;
+}
+
+static uint32_t
+HashCellKey(hash_grid Grid, uint32_t Key)
+{
+    // NOTE(said): Fibonacci hashing, the top bits are the well mixed ones.
+    uint32_t Slot = (Key * 2654435769u) >> (32 - Grid.TableBits);
+    return Slot;
+}
 
-    int Index = x + y * Grid.Width;
-    assert(Index >= 0 && Index < Grid.CellCount);
+static int
+FindCellSlot(hash_grid Grid, uint32_t Key)
+{
+    uint32_t Mask = Grid.TableSize - 1;
+    uint32_t Slot = HashCellKey(Grid, Key);
 
-    return Index;
+    while (true) {
+        uint32_t SlotKey = Grid.CellKeys[Slot];
+        if (SlotKey == Key) {
+            return Slot;
+        }
+        if (SlotKey == HASH_GRID_EMPTY_KEY) {
+            return -1;
+        }
+        Slot = (Slot + 1) & Mask;
+    }
 }
 
 static hash_grid_cell
 GetCell(hash_grid Grid, int x, int y)
 {
-    int CellIndex = GetCellIndex(Grid, x, y);
-
     hash_grid_cell Cell = {};
     Cell.x = x;
     Cell.y = y;
-    Cell.Index = CellIndex;
-    Cell.ParticleIndex = Grid.CellStart[CellIndex];
+    Cell.Key = GetCellKey(Grid, x, y);
+    Cell.Index = FindCellSlot(Grid, Cell.Key);
+    Cell.ParticleIndex = Cell.Index != -1 ? Grid.CellStart[Cell.Index] : -1;
+    Cell.ParticleEnd = Cell.Index != -1 ? Grid.CellEnd[Cell.Index] : -1;
 
     return Cell;
 }
@@ -36,10 +151,8 @@ GetCell(hash_grid Grid, int x, int y)
 static hash_grid_cell
 GetCell(hash_grid Grid, v2 P)
 {
-    P = P - Grid.WorldP;
-
-    int x = Clamp(0, (int)(P.x / Grid.CellDim), Grid.Width - 1);
-    int y = Clamp(0, (int)(P.y / Grid.CellDim), Grid.Height - 1);
+    int x, y;
+    GetCellCoords(Grid, P, &x, &y);
 
     hash_grid_cell Cell = GetCell(Grid, x, y);
     return Cell;
@@ -48,38 +161,288 @@ GetCell(hash_grid Grid, v2 P)
 static bool
 IsWithinBounds(hash_grid Grid, int x, int y)
 {
-   bool IsInvalid = x < 0 || x >= Grid.Width || y < 0 || y >= Grid.Height;
+   bool IsInvalid = x < 0 || x > HASH_GRID_MAX_COORD || y < 0 || y > HASH_GRID_MAX_COORD;
    return !IsInvalid;
 }
 
+static void
+ResizeHashTable(hash_grid *Grid, int TableBits)
+{
+    FreeLarge(Grid->CellKeys);
+    FreeLarge(Grid->CellStart);
+    FreeLarge(Grid->CellEnd);
+
+    Grid->TableBits = TableBits;
+    Grid->TableSize = 1 << TableBits;
+    Grid->CellKeys = (uint32_t *)AllocateLarge(Grid->TableSize * sizeof(uint32_t), Grid->PageMode);
+    Grid->CellStart = (int *)AllocateLarge(Grid->TableSize * sizeof(int), Grid->PageMode);
+    Grid->CellEnd = (int *)AllocateLarge(Grid->TableSize * sizeof(int), Grid->PageMode);
+}
+
+// NOTE(said): LSD radix sort on the cell key, 11 bits a pass, so at most
+// three passes and none for digits every key shares (the top bits of a
+// small world). The passes move 8 byte key and index pairs and the
+// particles are gathered once at the end. Equal keys keep their order, same
+// as the merge sort qsort used to do. Returns the number of occupied cells,
+// and if SortedFrom is given, the old index of every sorted particle in it.
+#define RADIX_SORT_BITS 11
+#define RADIX_SORT_BUCKETS (1 << RADIX_SORT_BITS)
+#define RADIX_SORT_PASSES ((32 + RADIX_SORT_BITS - 1) / RADIX_SORT_BITS)
+
 static int
-ParticleCellIndexCompare(const void *A, const void *B)
+SortParticlesByCellKey(int ParticleCount, particle *Particles, memory_arena *Arena, int *SortedFrom = 0)
 {
-    particle *ParticleA = (particle *)A;
-    particle *ParticleB = (particle *)B;
-    return ParticleA->CellIndex - ParticleB->CellIndex;
+    temporary_memory Temp = BeginTemporaryMemory(Arena);
+
+    uint64_t *Keys = PushArray(Arena, ParticleCount, uint64_t);
+    uint64_t *SwapKeys = PushArray(Arena, ParticleCount, uint64_t);
+    int *Counts = PushArray(Arena, RADIX_SORT_PASSES * RADIX_SORT_BUCKETS, int);
+    memset(Counts, 0, RADIX_SORT_PASSES * RADIX_SORT_BUCKETS * sizeof(int));
+
+    for (int i = 0; i < ParticleCount; ++i) {
+        uint32_t CellKey = Particles[i].CellKey;
+        Keys[i] = ((uint64_t)CellKey << 32) | (uint32_t)i;
+        for (int Pass = 0; Pass < RADIX_SORT_PASSES; ++Pass) {
+            uint32_t Digit = (CellKey >> (Pass * RADIX_SORT_BITS)) & (RADIX_SORT_BUCKETS - 1);
+            ++Counts[Pass * RADIX_SORT_BUCKETS + Digit];
+        }
+    }
+
+    for (int Pass = 0; Pass < RADIX_SORT_PASSES; ++Pass) {
+        int *PassCounts = Counts + Pass * RADIX_SORT_BUCKETS;
+        int Shift = 32 + Pass * RADIX_SORT_BITS;
+
+        if (ParticleCount == 0 || PassCounts[(Keys[0] >> Shift) & (RADIX_SORT_BUCKETS - 1)] == ParticleCount) {
+            continue;
+        }
+
+        int Offset = 0;
+        for (int Digit = 0; Digit < RADIX_SORT_BUCKETS; ++Digit) {
+            int Count = PassCounts[Digit];
+            PassCounts[Digit] = Offset;
+            Offset += Count;
+        }
+
+        for (int i = 0; i < ParticleCount; ++i) {
+            uint64_t Key = Keys[i];
+            SwapKeys[PassCounts[(Key >> Shift) & (RADIX_SORT_BUCKETS - 1)]++] = Key;
+        }
+
+        uint64_t *Swap = Keys;
+        Keys = SwapKeys;
+        SwapKeys = Swap;
+    }
+
+    particle *Sorted = PushArray(Arena, ParticleCount, particle);
+    int OccupiedCellCount = 0;
+    for (int i = 0; i < ParticleCount; ++i) {
+        Sorted[i] = Particles[(uint32_t)Keys[i]];
+        if (SortedFrom) {
+            SortedFrom[i] = (int)(uint32_t)Keys[i];
+        }
+        if ((i == 0 || (Keys[i] >> 32) != (Keys[i - 1] >> 32)) && Sorted[i].CellKey != HASH_GRID_DEAD_KEY) {
+            ++OccupiedCellCount;
+        }
+    }
+    memcpy(Particles, Sorted, ParticleCount * sizeof(particle));
+
+    EndTemporaryMemory(Temp);
+
+    return OccupiedCellCount;
 }
 
-static void
-ConstructSortedGrid(int ParticleCount, particle *Particles, hash_grid HashGrid)
+// NOTE(said): Returns the live particle count, removed particles end up
+// after it.
+static int
+ConstructSortedGrid(int ParticleCount, particle *Particles, hash_grid *HashGrid, memory_arena *Arena,
+                    int *SortedFrom = 0)
 {
-    // TODO(said): Implement my own sort, since the loop
-    // can probably be merged with the sort?
-    qsort(Particles, ParticleCount, sizeof(particle), ParticleCellIndexCompare);
+    int OccupiedCellCount = SortParticlesByCellKey(ParticleCount, Particles, Arena, SortedFrom);
+
+    while (ParticleCount > 0 && Particles[ParticleCount - 1].CellKey == HASH_GRID_DEAD_KEY) {
+        --ParticleCount;
+    }
+
+    // NOTE(said): Keep the load factor at or below one half so probe chains stay short.
+    int TableBits = HashGrid->TableBits;
+    while ((1 << TableBits) < 2 * OccupiedCellCount) {
+        ++TableBits;
+    }
+    if (TableBits != HashGrid->TableBits) {
+        ResizeHashTable(HashGrid, TableBits);
+    }
 
-    for (int i = 0; i < HashGrid.CellCount; ++i) {
-        HashGrid.CellStart[i] = -1;
+    for (int i = 0; i < HashGrid->TableSize; ++i) {
+        HashGrid->CellKeys[i] = HASH_GRID_EMPTY_KEY;
     }
 
-    int CurrentCellIndex = -1;
+    uint32_t Mask = HashGrid->TableSize - 1;
+    uint32_t CurrentCellKey = HASH_GRID_EMPTY_KEY;
+    int CurrentSlot = -1;
     for (int ParticleIndex = 0; ParticleIndex < ParticleCount; ++ParticleIndex) {
         particle Particle = Particles[ParticleIndex];
 
-        if (Particle.CellIndex != CurrentCellIndex) {
-            CurrentCellIndex = Particle.CellIndex;
-            HashGrid.CellStart[CurrentCellIndex] = ParticleIndex;
+        if (Particle.CellKey != CurrentCellKey) {
+            if (CurrentSlot != -1) {
+                HashGrid->CellEnd[CurrentSlot] = ParticleIndex;
+            }
+
+            CurrentCellKey = Particle.CellKey;
+
+            uint32_t Slot = HashCellKey(*HashGrid, CurrentCellKey);
+            while (HashGrid->CellKeys[Slot] != HASH_GRID_EMPTY_KEY) {
+                Slot = (Slot + 1) & Mask;
+            }
+            HashGrid->CellKeys[Slot] = CurrentCellKey;
+            HashGrid->CellStart[Slot] = ParticleIndex;
+            CurrentSlot = Slot;
         }
     }
+    if (CurrentSlot != -1) {
+        HashGrid->CellEnd[CurrentSlot] = ParticleCount;
+    }
+
+    return ParticleCount;
+}
+
+struct cell_offset {
+    int x;
+    int y;
+};
+
+static cell_offset FullStencil[] = {
+    {-1, -1}, {0, -1}, {1, -1},
+    {-1,  0}, {0,  0}, {1,  0},
+    {-1,  1}, {0,  1}, {1,  1},
+};
+
+// NOTE(said): The neighbours that come after a cell, every pair of adjacent
+// cells shows up in exactly one of their forward stencils.
+static cell_offset ForwardStencil[] = {
+              {1, 0},
+    {-1, 1}, {0, 1}, {1, 1},
+};
+
+static int
+GetStencilRanges(hash_grid Grid, int CellX, int CellY,
+                 cell_offset *Stencil, int StencilCount, particle_range *Ranges)
+{
+    int RangeCount = 0;
+    for (int i = 0; i < StencilCount; ++i) {
+        int x = CellX + Stencil[i].x;
+        int y = CellY + Stencil[i].y;
+        if (!IsWithinBounds(Grid, x, y)) {
+            continue;
+        }
+
+        int Slot = FindCellSlot(Grid, GetCellKey(Grid, x, y));
+        if (Slot == -1) {
+            continue;
+        }
+
+        // NOTE(said): Insertion sort by start, so runs that are next
+        // to each other in the particle array can be merged below.
+        particle_range Range = {Grid.CellStart[Slot], Grid.CellEnd[Slot]};
+        int Index = RangeCount++;
+        while (Index > 0 && Ranges[Index - 1].Start > Range.Start) {
+            Ranges[Index] = Ranges[Index - 1];
+            --Index;
+        }
+        Ranges[Index] = Range;
+    }
+
+    // NOTE(said): Row-major keys always merge the three cells of a row into
+    // one run, Morton keys merge whatever happens to be contiguous.
+    int MergedCount = 0;
+    for (int Index = 0; Index < RangeCount; ++Index) {
+        if (MergedCount > 0 && Ranges[MergedCount - 1].End == Ranges[Index].Start) {
+            Ranges[MergedCount - 1].End = Ranges[Index].End;
+        } else {
+            Ranges[MergedCount++] = Ranges[Index];
+        }
+    }
+
+    return MergedCount;
+}
+
+static int
+GetNeighborRanges(hash_grid Grid, int CellX, int CellY, particle_range *Ranges)
+{
+    int RangeCount = GetStencilRanges(Grid, CellX, CellY, FullStencil, ArrayCount(FullStencil), Ranges);
+    return RangeCount;
+}
+
+static int
+GetForwardNeighborRanges(hash_grid Grid, int CellX, int CellY, particle_range *Ranges)
+{
+    int RangeCount = GetStencilRanges(Grid, CellX, CellY, ForwardStencil, ArrayCount(ForwardStencil), Ranges);
+    return RangeCount;
+}
+
+static int
+ScheduledCellCompare(const void *A, const void *B)
+{
+    scheduled_cell *CellA = (scheduled_cell *)A;
+    scheduled_cell *CellB = (scheduled_cell *)B;
+    return (CellA->SortKey > CellB->SortKey) - (CellA->SortKey < CellB->SortKey);
+}
+
+static void
+BuildBlockSchedule(hash_grid Grid, block_schedule *Schedule, memory_arena *Arena)
+{
+    Schedule->Cells = PushArray(Arena, Grid.TableSize, scheduled_cell);
+    Schedule->Blocks = PushArray(Arena, Grid.TableSize, cell_block);
+
+    // NOTE(said): Sort key is colour, then block, then cell key, so each colour
+    // is one run of blocks and each block is one run of cells.
+    int CellCount = 0;
+    for (int Slot = 0; Slot < Grid.TableSize; ++Slot) {
+        uint32_t Key = Grid.CellKeys[Slot];
+        if (Key == HASH_GRID_EMPTY_KEY) {
+            continue;
+        }
+
+        int x, y;
+        GetCellCoords(Grid, Key, &x, &y);
+
+        uint64_t BlockX = x >> 1;
+        uint64_t BlockY = y >> 1;
+        uint64_t Color = (BlockX & 1) | ((BlockY & 1) << 1);
+
+        scheduled_cell *Cell = Schedule->Cells + CellCount++;
+        Cell->SortKey = (Color << 62) | (BlockY << 47) | (BlockX << 32) | Key;
+        Cell->Slot = Slot;
+    }
+
+    qsort(Schedule->Cells, CellCount, sizeof(scheduled_cell), ScheduledCellCompare);
+
+    int BlockCount = 0;
+    int Color = 0;
+    Schedule->ColorStart[0] = 0;
+    for (int CellIndex = 0; CellIndex < CellCount; ++CellIndex) {
+        scheduled_cell Cell = Schedule->Cells[CellIndex];
+
+        if (CellIndex == 0 || (Cell.SortKey >> 32) != (Schedule->Cells[CellIndex - 1].SortKey >> 32)) {
+            int CellColor = (int)(Cell.SortKey >> 62);
+            while (Color < CellColor) {
+                Schedule->ColorStart[++Color] = BlockCount;
+            }
+
+            cell_block *Block = Schedule->Blocks + BlockCount++;
+            Block->CellIndex = CellIndex;
+            Block->ParticleCount = 0;
+        }
+
+        cell_block *Block = Schedule->Blocks + BlockCount - 1;
+        Block->CellEnd = CellIndex + 1;
+        Block->ParticleCount += Grid.CellEnd[Cell.Slot] - Grid.CellStart[Cell.Slot];
+    }
+    while (Color < BLOCK_COLOR_COUNT) {
+        Schedule->ColorStart[++Color] = BlockCount;
+    }
+
+    Schedule->CellCount = CellCount;
+    Schedule->BlockCount = BlockCount;
 }
 
 struct sim_work {
@@ -88,8 +451,60 @@ struct sim_work {
 
     particle *Particles;
     hash_grid HashGrid;
+
+    // NOTE(said): Only used by the block passes, which walk
+    // [BlockIndex, BlockEnd) of the schedule instead of a particle range.
+    block_schedule *Schedule;
+    int BlockIndex;
+    int BlockEnd;
+    lambda_sums *LambdaSums;
+
+    float *Densities;
+    float *Pressures;
+
+    sim_config *Config;
+    sim_kernel Kernel;
+    float Dt;
+
+    sim_stats Stats;
 };
 
+static void
+MergeSimStats(sim_stats *Into, sim_stats *From)
+{
+    Into->ParticleCount += From->ParticleCount;
+    Into->MaxSpeedSq = fmaxf(Into->MaxSpeedSq, From->MaxSpeedSq);
+    Into->DensityErrorSum += From->DensityErrorSum;
+    Into->MaxDensityError = fmaxf(Into->MaxDensityError, From->MaxDensityError);
+    Into->CorrectionSum += From->CorrectionSum;
+    Into->MaxCorrectionSq = fmaxf(Into->MaxCorrectionSq, From->MaxCorrectionSq);
+}
+
+static void
+AddDensityError(sim_stats *Stats, float Constraint)
+{
+    // NOTE(said): Only compression counts, the free surface is
+    // always under rest density.
+    float Error = fmaxf(Constraint, 0.0f);
+    Stats->DensityErrorSum += Error;
+    Stats->MaxDensityError = fmaxf(Stats->MaxDensityError, Error);
+    ++Stats->ParticleCount;
+}
+
+// NOTE(said): The solver passes are templated on where the kernel constants
+// come from. generic_kernel reads them from the work at runtime, the
+// constant ones hand out a constexpr sim_kernel so the compiler can fold
+// the coefficients into the inner loops like it did when they were #defines.
+struct generic_kernel {
+    static sim_kernel Get(sim_work *Work) { return Work->Kernel; }
+};
+
+struct default_kernel {
+    static constexpr sim_kernel Kernel = MakeSimKernel(0.15f, 0.25f, 1000.0f, 300.0f, 0.1f, 0.3f);
+    static sim_kernel Get(sim_work *Work) { return Kernel; }
+};
+
+template <typename kernel_source>
 static void
 ComputeLambda(void *Data)
 {
@@ -98,172 +513,524 @@ ComputeLambda(void *Data)
     int ParticleIndex = Work->ParticleIndex;
     int ParticleEnd = Work->ParticleEnd;
     particle *Particles = Work->Particles;
-	hash_grid HashGrid = Work->HashGrid;
+    hash_grid HashGrid = Work->HashGrid;
+    sim_kernel K = kernel_source::Get(Work);
+
+    particle_range Ranges[MAX_NEIGHBOR_RANGES];
+    int RangeCount = 0;
+    uint32_t RangesKey = HASH_GRID_EMPTY_KEY;
+
+    sim_stats Stats = {};
 
     for (int i = ParticleIndex; i < ParticleEnd; ++i) {
         particle *P = Particles + i;
 
-        P->Density = 0;
+        // NOTE(said): Particles are sorted by cell, so the neighbour
+        // ranges only change when we move on to the next cell.
+        if (P->CellKey != RangesKey) {
+            hash_grid_cell CenterCell = GetCell(HashGrid, P->P);
+            RangeCount = GetNeighborRanges(HashGrid, CenterCell.x, CenterCell.y, Ranges);
+            RangesKey = P->CellKey;
+        }
+
+        float Density = 0;
         float SquaredGradSum = 0;
         v2 GradientOfI = {};
 
-		hash_grid_cell CenterCell = GetCell(HashGrid, P->P);
-        for (int Row = 0; Row < 3; ++Row) {
-            for (int Col = 0; Col < 3; ++Col) {
-                int CellX = CenterCell.x - 1 + Col;
-                int CellY = CenterCell.y - 1 + Row;
-                if (!IsWithinBounds(HashGrid, CellX, CellY)) {
-                    continue;
+        for (int RangeIndex = 0; RangeIndex < RangeCount; ++RangeIndex) {
+            particle_range Range = Ranges[RangeIndex];
+            for (int OtherIndex = Range.Start; OtherIndex < Range.End; ++OtherIndex) {
+                particle *N = Particles + OtherIndex;
+
+                v2 R = P->P - N->P;
+                float R2 = LengthSq(R);
+                if (R2 < K.H2) {
+                    Density += MassPoly6(K, R2);
+
+                    // NOTE(said): Also skips the particle itself.
+                    if (R2 > 0) {
+                        float InvRLen = InvSqrt(R2);
+                        float RLen = R2 * InvRLen;
+                        v2 Gradient = SpikyGrad(K, R, RLen, InvRLen);
+
+                        SquaredGradSum += Dot(Gradient, Gradient);
+                        GradientOfI += Gradient;
+                    }
                 }
+            }
+        }
+
+        // NOTE(said): The constraint gradients are the kernel gradients over
+        // the rest density, scale the sums once instead of every pair.
+        SquaredGradSum *= K.InvRestDensity * K.InvRestDensity;
+        GradientOfI *= K.InvRestDensity;
+
+        Work->Densities[i] = Density;
+
+        float Constraint = Density * K.InvRestDensity - 1;
+        float LambdaDenom = SquaredGradSum + Dot(GradientOfI, GradientOfI) + K.Relaxation;
+        Work->Pressures[i] = -Constraint / LambdaDenom;
+
+        AddDensityError(&Stats, Constraint);
+    }
+
+    MergeSimStats(&Work->Stats, &Stats);
+}
+
+static void
+AccumulateDensityPair(sim_kernel K, particle *P, particle *N, float *DensityOfN, lambda_sums *SumsOfN,
+                      float *Density, float *SquaredGradSum, v2 *GradientOfI)
+{
+    v2 R = P->P - N->P;
+    float R2 = LengthSq(R);
+    if (R2 < K.H2) {
+        float W = MassPoly6(K, R2);
+        *Density += W;
+        *DensityOfN += W;
+
+        if (R2 > 0) {
+            float InvRLen = InvSqrt(R2);
+            float RLen = R2 * InvRLen;
+            v2 Gradient = SpikyGrad(K, R, RLen, InvRLen);
+            float GradientSq = Dot(Gradient, Gradient);
+
+            // NOTE(said): The gradient is odd in R, so N gets the negated one.
+            *SquaredGradSum += GradientSq;
+            *GradientOfI += Gradient;
+            SumsOfN->SquaredGradSum += GradientSq;
+            SumsOfN->Gradient -= Gradient;
+        }
+    }
+}
+
+// NOTE(said): Symmetric version of the first half of ComputeLambda. Each pair
+// is evaluated once, from the cell that has the other one in its forward
+// stencil, and added to both particles. The writes reach at most one cell
+// outside the block, so only blocks of the same colour may run together.
+// Density and the lambda sums have to be zero going in.
+template <typename kernel_source>
+static void
+ComputeDensitySums(void *Data)
+{
+    sim_work *Work = (sim_work *)Data;
+    particle *Particles = Work->Particles;
+    hash_grid HashGrid = Work->HashGrid;
+    block_schedule *Schedule = Work->Schedule;
+    lambda_sums *Sums = Work->LambdaSums;
+    float *Densities = Work->Densities;
+    sim_kernel K = kernel_source::Get(Work);
 
-                int CellIndex = GetCellIndex(HashGrid, CellX, CellY);
-                for (int OtherIndex = HashGrid.CellStart[CellIndex];
-                     OtherIndex != -1 && CellIndex == Particles[OtherIndex].CellIndex;
-                     ++OtherIndex)
-                {
-					particle *N = Particles + OtherIndex;
+    float SelfDensity = MassPoly6(K, 0);
 
-					float R2 = LengthSq(P->P - N->P);
-					if (R2 < H2) {
+    for (int BlockIndex = Work->BlockIndex; BlockIndex < Work->BlockEnd; ++BlockIndex) {
+        cell_block Block = Schedule->Blocks[BlockIndex];
 
-						float A = H2 - R2;
-						P->Density += PARTICLE_MASS * (315.0f / (64.0f * (float)M_PI * H9)) * A * A * A;
+        for (int CellIndex = Block.CellIndex; CellIndex < Block.CellEnd; ++CellIndex) {
+            int Slot = Schedule->Cells[CellIndex].Slot;
+            int CellStart = HashGrid.CellStart[Slot];
+            int CellEnd = HashGrid.CellEnd[Slot];
 
-						if (i != OtherIndex) {
-							v2 R = P->P - N->P;
-							float RLen = Length(R);
+            int CellX, CellY;
+            GetCellCoords(HashGrid, HashGrid.CellKeys[Slot], &CellX, &CellY);
 
-							if (RLen > 0 && RLen < H) {
-								float A = H - RLen;
-								A = (-45.0f / ((float)M_PI * H6)) * A * A;
-								A /= RLen;
-								v2 Gradient = A * R;
+            particle_range Ranges[MAX_NEIGHBOR_RANGES];
+            int RangeCount = GetForwardNeighborRanges(HashGrid, CellX, CellY, Ranges);
 
-								Gradient *= (1.0f / REST_DENSITY);
+            for (int i = CellStart; i < CellEnd; ++i) {
+                particle *P = Particles + i;
 
-								SquaredGradSum += Dot(Gradient, Gradient);
-								GradientOfI += Gradient;
-							}
-						}
-					}
-				}
-			}
-		}
+                float Density = SelfDensity;
+                float SquaredGradSum = 0;
+                v2 GradientOfI = {};
 
-        float LambdaDenom = SquaredGradSum + Dot(GradientOfI, GradientOfI) + RELAXATION;
-        P->Pressure = -(P->Density / REST_DENSITY - 1) / LambdaDenom;
+                for (int OtherIndex = i + 1; OtherIndex < CellEnd; ++OtherIndex) {
+                    AccumulateDensityPair(K, P, Particles + OtherIndex, Densities + OtherIndex, Sums + OtherIndex,
+                                          &Density, &SquaredGradSum, &GradientOfI);
+                }
+
+                for (int RangeIndex = 0; RangeIndex < RangeCount; ++RangeIndex) {
+                    particle_range Range = Ranges[RangeIndex];
+                    for (int OtherIndex = Range.Start; OtherIndex < Range.End; ++OtherIndex) {
+                        AccumulateDensityPair(K, P, Particles + OtherIndex, Densities + OtherIndex, Sums + OtherIndex,
+                                              &Density, &SquaredGradSum, &GradientOfI);
+                    }
+                }
+
+                Densities[i] += Density;
+                Sums[i].SquaredGradSum += SquaredGradSum;
+                Sums[i].Gradient += GradientOfI;
+            }
+        }
     }
 }
 
+template <typename kernel_source>
 static void
-ComputeDeltaP(void *Data)
+ComputeLambdaFromSums(void *Data)
 {
     sim_work *Work = (sim_work *)Data;
-    particle *Particles = Work->Particles;
-	hash_grid HashGrid = Work->HashGrid;
+    lambda_sums *Sums = Work->LambdaSums;
+    sim_kernel K = kernel_source::Get(Work);
+
+    sim_stats Stats = {};
 
     for (int i = Work->ParticleIndex; i < Work->ParticleEnd; ++i) {
+        float SquaredGradSum = Sums[i].SquaredGradSum * K.InvRestDensity * K.InvRestDensity;
+        v2 GradientOfI = Sums[i].Gradient * K.InvRestDensity;
+
+        float Constraint = Work->Densities[i] * K.InvRestDensity - 1;
+        float LambdaDenom = SquaredGradSum + Dot(GradientOfI, GradientOfI) + K.Relaxation;
+        Work->Pressures[i] = -Constraint / LambdaDenom;
+
+        AddDensityError(&Stats, Constraint);
+    }
+
+    MergeSimStats(&Work->Stats, &Stats);
+}
+
+template <typename kernel_source>
+static void
+ComputeDeltaPRange(sim_work *Work, int ParticleIndex, int ParticleEnd, sim_stats *Stats)
+{
+    hash_grid HashGrid = Work->HashGrid;
+    sim_config *Config = Work->Config;
+    float *Pressures = Work->Pressures;
+    sim_kernel K = kernel_source::Get(Work);
+
+    float MinX = -Config->WorldWidth * 0.5f + Config->ParticleRadius;
+    float MaxX = Config->WorldWidth * 0.5f - Config->ParticleRadius;
+    float MinY = -Config->WorldHeight * 0.5f + Config->ParticleRadius;
+    float MaxY = Config->WorldHeight * 0.5f - Config->ParticleRadius;
+
+    particle_range Ranges[MAX_NEIGHBOR_RANGES];
+    int RangeCount = 0;
+    uint32_t RangesKey = HASH_GRID_EMPTY_KEY;
+
+    for (int i = ParticleIndex; i < ParticleEnd; ++i) {
         particle *P = Work->Particles + i;
 
+        if (P->CellKey != RangesKey) {
+            hash_grid_cell CenterCell = GetCell(HashGrid, P->P);
+            RangeCount = GetNeighborRanges(HashGrid, CenterCell.x, CenterCell.y, Ranges);
+            RangesKey = P->CellKey;
+        }
+
         v2 DeltaP = {};
 
-		hash_grid_cell CenterCell = GetCell(HashGrid, P->P);
-        for (int Row = 0; Row < 3; ++Row) {
-            for (int Col = 0; Col < 3; ++Col) {
-                int CellX = CenterCell.x - 1 + Col;
-                int CellY = CenterCell.y - 1 + Row;
-                if (!IsWithinBounds(HashGrid, CellX, CellY)) {
-                    continue;
+        for (int RangeIndex = 0; RangeIndex < RangeCount; ++RangeIndex) {
+            particle_range Range = Ranges[RangeIndex];
+            for (int OtherIndex = Range.Start; OtherIndex < Range.End; ++OtherIndex) {
+                particle *N = Work->Particles + OtherIndex;
+
+                v2 R = P->P - N->P;
+                float R2 = LengthSq(R);
+
+                // NOTE(said): R2 > 0 also skips the particle itself.
+                if (R2 > 0 && R2 < K.H2) {
+                    float InvRLen = InvSqrt(R2);
+                    float RLen = R2 * InvRLen;
+                    v2 Gradient = SpikyGrad(K, R, RLen, InvRLen);
+
+                    float S = Scorr(K, Poly6(K, R2));
+
+                    DeltaP += (Pressures[OtherIndex] + Pressures[i] + S) * Gradient;
                 }
+            }
+        }
 
-                int CellIndex = GetCellIndex(HashGrid, CellX, CellY);
-                for (int OtherIndex = HashGrid.CellStart[CellIndex];
-                     OtherIndex != -1 && CellIndex == Particles[OtherIndex].CellIndex;
-                     ++OtherIndex)
-                {
-
-            		if (i == OtherIndex) continue;
-
-            		particle *N = Work->Particles + OtherIndex;
-
-					v2 R = P->P - N->P;
-					float RLen = Length(R);
-					float R2 = LengthSq(R);
-
-					if (RLen > 0 && RLen < H) {
-						float A = H - RLen;
-						A = (-45.0f / ((float)M_PI * H6)) * A * A;
-						A /= RLen;
-						v2 Gradient = A * R;
-
-						const float k = 0.1f;
-						A = H2 - R2;
-						float Scorr = 0;
-						if (A > 0) {
-							float Numerator = (315.0f / (64.0f * (float)M_PI * H9)) * A * A * A;
-							A = 0.3f * H;
-							float Denomerator = (315.0f / (64.0f * (float)M_PI * H9)) * A * A * A;
-							Scorr = Numerator / Denomerator;
-						}
-
-						Scorr *= Scorr;
-						Scorr *= Scorr;
-						Scorr *= -k;
-
-						DeltaP += (N->Pressure + P->Pressure + Scorr) * Gradient;
-					}
-				}
-			}
-		}
-
-        DeltaP *= (1.0f / REST_DENSITY);
+        DeltaP *= K.InvRestDensity;
         P->P += DeltaP;
 
-        P->V = (P->P - P->P0) * (1.0f / dt);
+        float CorrectionSq = LengthSq(DeltaP);
+        Stats->CorrectionSum += sqrtf(CorrectionSq);
+        Stats->MaxCorrectionSq = fmaxf(Stats->MaxCorrectionSq, CorrectionSq);
+
+        // NOTE(said): The prediction moved P by V * dt, so this is the same
+        // as the distance covered over dt without keeping the start around.
+        P->V += DeltaP * (1.0f / Work->Dt);
 
-        float Elasticity = 0.1f;
+        float Elasticity = Config->Elasticity;
 
-        if (P->P.x < -WORLD_WIDTH * 0.5f + PARTICLE_RADIUS) {
-            P->P.x = -WORLD_WIDTH * 0.5f + PARTICLE_RADIUS;
+        if (P->P.x < MinX) {
+            P->P.x = MinX;
             P->V.x = -P->V.x * Elasticity;
-        } else if (P->P.x > WORLD_WIDTH * 0.5f - PARTICLE_RADIUS) {
-            P->P.x = WORLD_WIDTH * 0.5f - PARTICLE_RADIUS;
+        } else if (P->P.x > MaxX) {
+            P->P.x = MaxX;
             P->V.x = -P->V.x * Elasticity;
         }
 
-        if (P->P.y < -WORLD_HEIGHT * 0.5f + PARTICLE_RADIUS) {
-            P->P.y = -WORLD_HEIGHT * 0.5f + PARTICLE_RADIUS;
+        if (P->P.y < MinY) {
+            P->P.y = MinY;
             P->V.y = -P->V.y * Elasticity;
-        } else if (P->P.y > WORLD_HEIGHT * 0.5f - PARTICLE_RADIUS) {
-            P->P.y = WORLD_HEIGHT * 0.5f - PARTICLE_RADIUS;
+        } else if (P->P.y > MaxY) {
+            P->P.y = MaxY;
             P->V.y = -P->V.y * Elasticity;
         }
+
+        Stats->MaxSpeedSq = fmaxf(Stats->MaxSpeedSq, LengthSq(P->V));
     }
 }
 
+template <typename kernel_source>
+static void
+ComputeDeltaP(void *Data)
+{
+    sim_work *Work = (sim_work *)Data;
+
+    sim_stats Stats = {};
+    ComputeDeltaPRange<kernel_source>(Work, Work->ParticleIndex, Work->ParticleEnd, &Stats);
+    MergeSimStats(&Work->Stats, &Stats);
+}
+
+// NOTE(said): Same update, walked block by block. A particle reads positions
+// at most one cell outside its block and blocks of one colour are two cells
+// apart, so updating positions in place is race free within a colour batch
+// and the Gauss-Seidel order only depends on the schedule.
+template <typename kernel_source>
+static void
+ComputeDeltaPBlocks(void *Data)
+{
+    sim_work *Work = (sim_work *)Data;
+    hash_grid HashGrid = Work->HashGrid;
+    block_schedule *Schedule = Work->Schedule;
+
+    sim_stats Stats = {};
+
+    for (int BlockIndex = Work->BlockIndex; BlockIndex < Work->BlockEnd; ++BlockIndex) {
+        cell_block Block = Schedule->Blocks[BlockIndex];
+
+        for (int CellIndex = Block.CellIndex; CellIndex < Block.CellEnd; ++CellIndex) {
+            int Slot = Schedule->Cells[CellIndex].Slot;
+            ComputeDeltaPRange<kernel_source>(Work, HashGrid.CellStart[Slot], HashGrid.CellEnd[Slot], &Stats);
+        }
+    }
+
+    MergeSimStats(&Work->Stats, &Stats);
+}
+
+struct kernel_specialization {
+    const char *Name;
+    sim_kernel Kernel;
+    work_queue_proc ComputeLambda;
+    work_queue_proc ComputeDensitySums;
+    work_queue_proc ComputeLambdaFromSums;
+    work_queue_proc ComputeDeltaP;
+    work_queue_proc ComputeDeltaPBlocks;
+};
+
+#define KERNEL_SPECIALIZATION(source) {#source, source::Kernel, ComputeLambda<source>, \
+    ComputeDensitySums<source>, ComputeLambdaFromSums<source>, ComputeDeltaP<source>, ComputeDeltaPBlocks<source>}
+
+static kernel_specialization KernelSpecializations[] = {
+    KERNEL_SPECIALIZATION(default_kernel),
+};
+
+static bool
+MatchesKernelParameters(sim_kernel A, sim_kernel B)
+{
+    bool Result = (A.H == B.H &&
+                   A.Mass == B.Mass &&
+                   A.RestDensity == B.RestDensity &&
+                   A.Relaxation == B.Relaxation &&
+                   A.ScorrK == B.ScorrK &&
+                   A.ScorrDeltaQ == B.ScorrDeltaQ);
+    return Result;
+}
+
+static void
+SelectSolverProcs(sim *Sim)
+{
+    Sim->ComputeLambdaProc = ComputeLambda<generic_kernel>;
+    Sim->ComputeDensitySumsProc = ComputeDensitySums<generic_kernel>;
+    Sim->ComputeLambdaFromSumsProc = ComputeLambdaFromSums<generic_kernel>;
+    Sim->ComputeDeltaPProc = ComputeDeltaP<generic_kernel>;
+    Sim->ComputeDeltaPBlocksProc = ComputeDeltaPBlocks<generic_kernel>;
+
+    const char *Name = "generic_kernel";
+    for (int i = 0; i < (int)ArrayCount(KernelSpecializations); ++i) {
+        kernel_specialization *Specialization = KernelSpecializations + i;
+        if (MatchesKernelParameters(Sim->Kernel, Specialization->Kernel)) {
+            Sim->ComputeLambdaProc = Specialization->ComputeLambda;
+            Sim->ComputeDensitySumsProc = Specialization->ComputeDensitySums;
+            Sim->ComputeLambdaFromSumsProc = Specialization->ComputeLambdaFromSums;
+            Sim->ComputeDeltaPProc = Specialization->ComputeDeltaP;
+            Sim->ComputeDeltaPBlocksProc = Specialization->ComputeDeltaPBlocks;
+            Name = Specialization->Name;
+            break;
+        }
+    }
+
+    printf("Using solver kernel %s\n", Name);
+}
+
+// NOTE(said): FNV-1a over the particle array and the clock. particle has no
+// padding, so hashing its bytes is fine.
+static uint64_t
+HashSimState(sim *Sim)
+{
+    uint64_t Hash = 0xcbf29ce484222325ull;
+
+    uint8_t *Bytes = (uint8_t *)Sim->Particles;
+    size_t Size = Sim->ParticleCount * sizeof(particle);
+    for (size_t i = 0; i < Size; ++i) {
+        Hash = (Hash ^ Bytes[i]) * 0x100000001b3ull;
+    }
+
+    Bytes = (uint8_t *)&Sim->Time;
+    for (size_t i = 0; i < sizeof(Sim->Time); ++i) {
+        Hash = (Hash ^ Bytes[i]) * 0x100000001b3ull;
+    }
+
+    return Hash;
+}
+
+static sim_diagnostics
+GetSimDiagnostics(sim_stats *Stats)
+{
+    sim_diagnostics Diagnostics = {};
+
+    Diagnostics.MaxSpeed = sqrtf(Stats->MaxSpeedSq);
+    Diagnostics.MaxDensityError = Stats->MaxDensityError;
+    Diagnostics.MaxCorrection = sqrtf(Stats->MaxCorrectionSq);
+    if (Stats->ParticleCount > 0) {
+        Diagnostics.DensityError = Stats->DensityErrorSum / Stats->ParticleCount;
+        Diagnostics.Correction = Stats->CorrectionSum / Stats->ParticleCount;
+    }
+
+    return Diagnostics;
+}
+
+static float
+ChooseNextDt(sim *Sim)
+{
+    sim_config *Config = &Sim->Config;
+    float Dt = Sim->Dt;
+
+    float NextDt = Config->MaxDt;
+    sim_diagnostics *Diagnostics = &Sim->Diagnostics;
+    if (Diagnostics->MaxSpeed > 0) {
+        NextDt = fminf(NextDt, Config->Cfl * Config->H / Diagnostics->MaxSpeed);
+    }
+
+    // NOTE(said): The compression left after a solve grows roughly with dt
+    // squared, so shrink by the square root of the overshoot. Never more
+    // than half per step, and grow slowly so one calm step doesn't blow up.
+    if (Diagnostics->DensityError > Config->MaxDensityError) {
+        float Shrink = sqrtf(Config->MaxDensityError / Diagnostics->DensityError);
+        NextDt = fminf(NextDt, Dt * fmaxf(0.5f, Shrink));
+    }
+    NextDt = fminf(NextDt, Dt * 1.25f);
+
+    NextDt = Clamp(Config->MinDt, NextDt, Config->MaxDt);
+    return NextDt;
+}
+
+// NOTE(said): One batch per colour. Blocks are grouped into works of roughly
+// a tile's worth of particles, the blocks in a batch never touch the same
+// cells so its works can run in any order. Returns the number of works used.
+static int
+RunColoredBlocks(work_queue *Queue, sim_work *Template, block_schedule *Schedule,
+                 sim_work *Works, int WorkCapacity, int TileSize, work_queue_proc Proc)
+{
+    int WorkCount = 0;
+    for (int Color = 0; Color < BLOCK_COLOR_COUNT; ++Color) {
+        int BlockIndex = Schedule->ColorStart[Color];
+        int ColorEnd = Schedule->ColorStart[Color + 1];
+
+        while (BlockIndex < ColorEnd) {
+            assert(WorkCount < WorkCapacity);
+            sim_work *Work = Works + WorkCount++;
+
+            *Work = *Template;
+            Work->Stats = {};
+            Work->Schedule = Schedule;
+            Work->BlockIndex = BlockIndex;
+
+            int WorkParticleCount = 0;
+            while (BlockIndex < ColorEnd && WorkParticleCount < TileSize) {
+                WorkParticleCount += Schedule->Blocks[BlockIndex++].ParticleCount;
+            }
+            Work->BlockEnd = BlockIndex;
+
+            AddEntry(Queue, Work, Proc);
+        }
+        FinishWork(Queue);
+    }
+
+    return WorkCount;
+}
+
+// NOTE(said): Fills the slots the sink freed this step first, then the end
+// of the pool. Returns the new end of the particle array, dead particles
+// included, the sort compacts it.
+static int
+EmitParticles(sim *Sim, float dt, int *FreeSlots, int FreeSlotCount)
+{
+    particle_emitter Emitter = Sim->Config.Emitter;
+    int End = Sim->ParticleCount;
+    if (Emitter.Rate <= 0.0f || Emitter.Radius <= 0.0f) {
+        return End;
+    }
+
+    Sim->EmitAccumulator += Emitter.Rate * dt;
+    int EmitCount = (int)Sim->EmitAccumulator;
+    Sim->EmitAccumulator -= (float)EmitCount;
+
+    int Available = FreeSlotCount + (Sim->ParticleCapacity - End);
+    if (EmitCount > Available) {
+        EmitCount = Available;
+    }
+
+    for (int i = 0; i < EmitCount; ++i) {
+        int Index = (i < FreeSlotCount) ? FreeSlots[i] : End++;
+
+        v2 Offset;
+        do {
+            Offset = V2(RandomBilateral(&Sim->Series), RandomBilateral(&Sim->Series));
+        } while (LengthSq(Offset) > 1.0f);
+
+        particle *P = Sim->Particles + Index;
+        *P = {};
+        P->V = Emitter.V;
+        P->P = Emitter.P + Emitter.Radius * Offset + P->V * dt;
+        P->CellKey = GetCellKey(Sim->HashGrid, P->P);
+    }
+
+    return End;
+}
+
 static void
 Simulate(sim *Sim)
 {
     hash_grid HashGrid = Sim->HashGrid;
     int ParticleCount = Sim->ParticleCount;
     particle *Particles = Sim->Particles;
+    sim_config *Config = &Sim->Config;
+    float dt = Sim->Dt;
+    float WorldWidth = Config->WorldWidth;
+
+    memory_arena *Arena = &Sim->StepArena;
+    ResetArena(Arena);
+
+    particle_sink Sink = Config->Sink;
+    bool HasSink = Sink.Radius > 0.0f;
+    int *FreeSlots = HasSink ? PushArray(Arena, ParticleCount, int) : 0;
+    int FreeSlotCount = 0;
 
     for (int ParticleIndex = 0; ParticleIndex < ParticleCount; ++ParticleIndex) {
         particle *P = &Particles[ParticleIndex];
 
-        P->P0 = P->P;
-
         if (Sim->Pulling) {
             P->V += (Sim->PullPoint - P->P) * 3.0f * dt;
         }
         P->V += Sim->Gravity * dt;
 
         { // NOTE(said): Waves
-            v2 WaveP = V2(fmodf(2.0f * Sim->Time, WORLD_WIDTH), 0);
-            WaveP.x -= WORLD_WIDTH * 0.5f;
+            v2 WaveP = V2(fmodf(2.0f * Sim->Time, WorldWidth), 0);
+            WaveP.x -= WorldWidth * 0.5f;
 
             float D = P->P.x - WaveP.x;
-            D /= 0.125f * WORLD_WIDTH;
+            D /= 0.125f * WorldWidth;
 
             if (D > 0 && D < 1) {
                 P->V.x += 10.0f * dt;
@@ -272,24 +1039,56 @@ Simulate(sim *Sim)
 
         P->P += P->V * dt;
 
-        P->CellIndex = GetCellIndex(HashGrid, P->P);
+        if (HasSink && LengthSq(P->P - Sink.P) < Sink.Radius * Sink.Radius) {
+            P->CellKey = HASH_GRID_DEAD_KEY;
+            FreeSlots[FreeSlotCount++] = ParticleIndex;
+            continue;
+        }
+
+        P->CellKey = GetCellKey(HashGrid, P->P);
+    }
+
+    // NOTE(said): The live count changes here, everything after (tiles,
+    // schedule, stats) goes by the new one.
+    ParticleCount = EmitParticles(Sim, dt, FreeSlots, FreeSlotCount);
+    ParticleCount = ConstructSortedGrid(ParticleCount, Particles, &Sim->HashGrid, Arena);
+    Sim->ParticleCount = ParticleCount;
+    HashGrid = Sim->HashGrid;
+
+    bool Symmetric = Config->SymmetricLambda != 0;
+    bool Colored = Config->ColoredDeltaP != 0;
+    Sim->BlockSchedule = {};
+    if (Symmetric || Colored) {
+        BuildBlockSchedule(HashGrid, &Sim->BlockSchedule, Arena);
     }
 
-    ConstructSortedGrid(ParticleCount, Particles, HashGrid);
+    Sim->Densities = PushArray(Arena, ParticleCount, float);
+    Sim->Pressures = PushArray(Arena, ParticleCount, float);
+
+    // NOTE(said): The symmetric pass accumulates into these.
+    Sim->LambdaSums = 0;
+    if (Symmetric) {
+        Sim->LambdaSums = PushArray(Arena, ParticleCount, lambda_sums);
+        memset(Sim->LambdaSums, 0, ParticleCount * sizeof(lambda_sums));
+        memset(Sim->Densities, 0, ParticleCount * sizeof(float));
+    }
 
     work_queue *Queue = &GlobalWorkQueue;
     ResetQueue(Queue);
 
-    sim_work Works[2048];
-    int WorkCount = 0;
-
     int TileSize = 64;
     int TileCount = (ParticleCount + TileSize - 1) / TileSize;
 
+    // NOTE(said): A block pass never has more works than blocks, each work
+    // takes at least one.
+    int BlockWorkCapacity = Sim->BlockSchedule.BlockCount;
+    sim_work *Works = PushArray(Arena, TileCount + BlockWorkCapacity, sim_work);
+    int WorkCount = 0;
+
     for (int i = 0; i < TileCount; ++i) {
-        assert(WorkCount < 2048);
         sim_work *Work = Works + WorkCount++;
 
+        *Work = {};
         Work->ParticleIndex = i * TileSize;
         Work->ParticleEnd = Work->ParticleIndex + TileSize;
         if (Work->ParticleEnd > ParticleCount) {
@@ -297,62 +1096,315 @@ Simulate(sim *Sim)
         }
         Work->Particles = Particles;
         Work->HashGrid = HashGrid;
+        Work->LambdaSums = Sim->LambdaSums;
+        Work->Densities = Sim->Densities;
+        Work->Pressures = Sim->Pressures;
+        Work->Config = Config;
+        Work->Kernel = Sim->Kernel;
+        Work->Dt = dt;
+    }
 
-        AddEntry(Queue, Work, ComputeLambda);
+    // NOTE(said): The block passes put their works after the tiles.
+    sim_work *BlockWorks = Works + WorkCount;
+
+    if (Symmetric) {
+        RunColoredBlocks(Queue, Works, &Sim->BlockSchedule, BlockWorks, BlockWorkCapacity,
+                         TileSize, Sim->ComputeDensitySumsProc);
+
+        for (int i = 0; i < TileCount; ++i) {
+            AddEntry(Queue, Works + i, Sim->ComputeLambdaFromSumsProc);
+        }
+        FinishWork(Queue);
+    } else {
+        for (int i = 0; i < TileCount; ++i) {
+            AddEntry(Queue, Works + i, Sim->ComputeLambdaProc);
+        }
+        FinishWork(Queue);
+    }
+
+    int BlockWorkCount = 0;
+    if (Colored) {
+        BlockWorkCount = RunColoredBlocks(Queue, Works, &Sim->BlockSchedule, BlockWorks, BlockWorkCapacity,
+                                          TileSize, Sim->ComputeDeltaPBlocksProc);
+    } else {
+        for (int i = 0; i < TileCount; ++i) {
+            AddEntry(Queue, Works + i, Sim->ComputeDeltaPProc);
+        }
+        FinishWork(Queue);
     }
-    FinishWork(Queue);
 
-    WorkCount = 0;
+    // NOTE(said): Partials are per work item rather than per thread, the
+    // items are the same every run while the threads that pick them up
+    // aren't, so merging in item order keeps the sums reproducible.
+    sim_stats Stats = {};
     for (int i = 0; i < TileCount; ++i) {
-        assert(WorkCount < 2048);
-        sim_work *Work = Works + WorkCount++;
-        AddEntry(Queue, Work, ComputeDeltaP);
+        MergeSimStats(&Stats, &Works[i].Stats);
+    }
+    for (int i = 0; i < BlockWorkCount; ++i) {
+        MergeSimStats(&Stats, &BlockWorks[i].Stats);
     }
-    FinishWork(Queue);
+    Sim->Diagnostics = GetSimDiagnostics(&Stats);
 
     Sim->Time += dt;
+    Sim->LastDt = dt;
+    ++Sim->StepIndex;
+
+    if (Config->Deterministic) {
+        printf("step %llu time %.9g hash %016llx\n",
+               (unsigned long long)Sim->StepIndex, Sim->Time,
+               (unsigned long long)HashSimState(Sim));
+    }
+
+    if (Config->AdaptiveDt) {
+        Sim->Dt = ChooseNextDt(Sim);
+    }
+}
+
+static size_t
+GetHashTableSize(hash_grid *Grid)
+{
+    size_t Result = Grid->TableSize * (sizeof(uint32_t) + 2 * sizeof(int));
+    return Result;
+}
+
+static void
+GetSimMemoryUsage(sim *Sim, memory_usage *Memory)
+{
+    Memory->Particles = Sim->ParticleCapacity * sizeof(particle);
+    Memory->HashGrid = GetHashTableSize(&Sim->HashGrid);
+    Memory->StepArena = Sim->StepArena.Size + Sim->StepArena.OverflowSize;
+    Memory->StepArenaHighWater = Sim->StepArena.HighWater;
 }
 
 static void
-InitSim(sim *Sim)
+CopySimSnapshot(sim_snapshot *Snapshot, sim *Sim)
+{
+    if (Snapshot->ParticleCapacity < Sim->ParticleCount) {
+        Snapshot->ParticleCapacity = Sim->ParticleCount;
+        Snapshot->Particles = (particle *)realloc(Snapshot->Particles, Snapshot->ParticleCapacity * sizeof(particle));
+    }
+    Snapshot->ParticleCount = Sim->ParticleCount;
+    memcpy(Snapshot->Particles, Sim->Particles, Sim->ParticleCount * sizeof(particle));
+
+    hash_grid *Grid = &Snapshot->HashGrid;
+    if (Grid->TableBits != Sim->HashGrid.TableBits) {
+        ResizeHashTable(Grid, Sim->HashGrid.TableBits);
+    }
+
+    uint32_t *CellKeys = Grid->CellKeys;
+    int *CellStart = Grid->CellStart;
+    int *CellEnd = Grid->CellEnd;
+
+    // NOTE(said): Snapshots are copied every step and only read, they
+    // don't need to take huge pages away from the sim.
+    *Grid = Sim->HashGrid;
+    Grid->CellKeys = CellKeys;
+    Grid->CellStart = CellStart;
+    Grid->CellEnd = CellEnd;
+    Grid->PageMode = PageMode_Normal;
+
+    memcpy(Grid->CellKeys, Sim->HashGrid.CellKeys, Grid->TableSize * sizeof(uint32_t));
+    memcpy(Grid->CellStart, Sim->HashGrid.CellStart, Grid->TableSize * sizeof(int));
+    memcpy(Grid->CellEnd, Sim->HashGrid.CellEnd, Grid->TableSize * sizeof(int));
+
+    Snapshot->Time = Sim->Time;
+    Snapshot->Dt = Sim->LastDt;
+    Snapshot->StepIndex = Sim->StepIndex;
+    Snapshot->NextDt = Sim->Dt;
+    Snapshot->Gravity = Sim->Gravity;
+    Snapshot->Series = Sim->Series;
+    Snapshot->EmitAccumulator = Sim->EmitAccumulator;
+    Snapshot->Diagnostics = Sim->Diagnostics;
+    Snapshot->Config = Sim->Config;
+
+    GetSimMemoryUsage(Sim, &Snapshot->Memory);
+    Snapshot->Memory.Snapshot = (Snapshot->ParticleCapacity * sizeof(particle) +
+                                 GetHashTableSize(&Snapshot->HashGrid));
+}
+
+static sim_config
+DefaultSimConfig()
 {
-    int ParticleCount = PARTICLES_PER_AXIS * PARTICLES_PER_AXIS;
-    particle *Particles = (particle *)malloc(ParticleCount * sizeof(particle));
+    sim_config Config = {};
+
+    Config.ParticlesPerAxis = 200;
+    Config.ParticleRadius = 0.0125f;
+    Config.ParticleMass = 0.25f;
+    Config.Dt = 0.008f;
+
+    Config.AdaptiveDt = 0;
+    Config.MinDt = 0.001f;
+    Config.MaxDt = 0.016f;
+    Config.Cfl = 1.0f;
+    Config.MaxDensityError = 0.1f;
+
+    Config.RestDensity = 1000.0f;
+    Config.Relaxation = 300.0f;
+    Config.H = 0.15f;
+
+    Config.ScorrK = 0.1f;
+    Config.ScorrDeltaQ = 0.3f;
+    Config.Elasticity = 0.1f;
+
+    Config.WorldWidth = 10.0f;
+    Config.WorldHeight = 10.0f;
+    Config.Gravity = V2(0, -9.81f);
+
+    Config.GridOrder = GridOrder_Morton;
+    Config.SymmetricLambda = 1;
+    Config.ColoredDeltaP = 1;
+
+    Config.Deterministic = 0;
+    Config.Seed = 1;
+    Config.InitialJitter = 0.0f;
+
+    Config.ParticleCapacity = 0;
+    Config.Emitter = {};
+    Config.Sink = {};
+
+    Config.HugePages = PageMode_Normal;
+
+    return Config;
+}
+
+static sim_kernel
+MakeSimKernel(sim_config *Config)
+{
+    sim_kernel Kernel = MakeSimKernel(
+            Config->H, Config->ParticleMass, Config->RestDensity,
+            Config->Relaxation, Config->ScorrK, Config->ScorrDeltaQ);
+    return Kernel;
+}
+
+// NOTE(said): Everything but the particles, shared by InitSim and
+// checkpoint restore.
+static void
+SetupSim(sim *Sim, sim_config *Config)
+{
+    Sim->Config = *Config;
+    Sim->Kernel = MakeSimKernel(Config);
+
+    // NOTE(said): The tile version of the position update races on
+    // neighbouring positions, everything else is already on a fixed schedule.
+    if (Config->Deterministic && !Config->ColoredDeltaP) {
+        printf("Deterministic mode, using colored_delta_p=1\n");
+        Sim->Config.ColoredDeltaP = 1;
+    }
+
+    Sim->Dt = Config->Dt;
+    if (Config->AdaptiveDt) {
+        Sim->Dt = Clamp(Config->MinDt, Sim->Dt, Config->MaxDt);
+    }
+    Sim->LastDt = Sim->Dt;
+    SelectSolverProcs(Sim);
+
+    hash_grid Grid = {};
+
+    Grid.WorldP = V2(Config->WorldWidth, Config->WorldHeight) * -0.5f;
+    Grid.CellDim = Config->H;
+    Grid.InvCellDim = 1.0f / Grid.CellDim;
+    Grid.Order = Config->GridOrder;
+    Grid.PageMode = Config->HugePages;
+
+    // NOTE(said): The table grows with the number of occupied cells,
+    // the size of the world doesn't matter.
+    ResizeHashTable(&Grid, 10);
+
+    Sim->HashGrid = Grid;
+
+    Sim->Gravity = Config->Gravity;
+    Sim->Series = RandomSeed(Config->Seed);
+
+    Sim->StepArena.PageMode = Config->HugePages;
+}
+
+// NOTE(said): Grows the pool, for a restore with a bigger capacity than
+// the checkpoint had and for replay frames. A mapped array is copied out and the mapping left as
+// is, nothing else points into it.
+static void
+ReserveParticles(sim *Sim, int Capacity)
+{
+    if (Capacity <= Sim->ParticleCapacity) {
+        return;
+    }
+
+    particle *Particles = (particle *)AllocateLarge(Capacity * sizeof(particle), Sim->Config.HugePages);
+    memcpy(Particles, Sim->Particles, Sim->ParticleCount * sizeof(particle));
+    if (Sim->ParticleMapping) {
+        UnmapFile(Sim->ParticleMapping, Sim->ParticleMappingSize);
+        Sim->ParticleMapping = 0;
+        Sim->ParticleMappingSize = 0;
+    } else {
+        FreeLarge(Sim->Particles);
+    }
+
+    Sim->Particles = Particles;
+    Sim->ParticleCapacity = Capacity;
+}
+
+// NOTE(said): Emitters stop when the pool is full, so a restored run needs
+// the same pool as the one it was saved from.
+static int
+GetParticlePoolSize(sim_config *Config)
+{
+    int Result = Config->ParticlesPerAxis * Config->ParticlesPerAxis;
+    if (Result < Config->ParticleCapacity) {
+        Result = Config->ParticleCapacity;
+    }
+    return Result;
+}
+
+static void
+InitSim(sim *Sim, sim_config *Config)
+{
+    SetupSim(Sim, Config);
+
+    int ParticlesPerAxis = Config->ParticlesPerAxis;
+    int ParticleCount = ParticlesPerAxis * ParticlesPerAxis;
+    int ParticleCapacity = GetParticlePoolSize(Config);
+    particle *Particles = (particle *)AllocateLarge(ParticleCapacity * sizeof(particle), Config->HugePages);
+
+    random_series Series = RandomSeed(Config->Seed);
 
     float Gap = 0.1f;
-    float Spacing = Gap + 2.0 * PARTICLE_RADIUS;
+    float Spacing = Gap + 2.0 * Config->ParticleRadius;
     for (int i = 0; i < ParticleCount; ++i) {
-        float x = (i % PARTICLES_PER_AXIS) * Spacing;
-        float y = (i / PARTICLES_PER_AXIS) * Spacing;
+        float x = (i % ParticlesPerAxis) * Spacing;
+        float y = (i / ParticlesPerAxis) * Spacing;
 
-        x -= Spacing * PARTICLES_PER_AXIS * 0.5f;
-        y -= Spacing * PARTICLES_PER_AXIS * 0.5f;
+        x -= Spacing * ParticlesPerAxis * 0.5f;
+        y -= Spacing * ParticlesPerAxis * 0.5f;
 
         Particles[i].P = V2(x, y);
-
-        float V = 4.0f;
-        Particles[i].V = V2(
-                V * ((float)rand() / (float)RAND_MAX - 0.5f),
-                V * ((float)rand() / (float)RAND_MAX - 0.5f));
         Particles[i].V = V2(0);
+
+        if (Config->InitialJitter > 0.0f) {
+            Particles[i].V = Config->InitialJitter * V2(
+                    RandomBilateral(&Series),
+                    RandomBilateral(&Series));
+        }
     }
 
     Sim->ParticleCount = ParticleCount;
+    Sim->ParticleCapacity = ParticleCapacity;
     Sim->Particles = Particles;
 
     printf("Simulating %d particles...\n", Sim->ParticleCount);
+}
 
-    hash_grid Grid = {};
-
-    Grid.WorldP = V2(WORLD_WIDTH, WORLD_HEIGHT) * -0.5f;
-    Grid.CellDim = H;
-
-    Grid.Width = WORLD_WIDTH / Grid.CellDim;
-    Grid.Height = WORLD_HEIGHT / Grid.CellDim;
-    Grid.CellCount = Grid.Width * Grid.Height;
-    Grid.CellStart = (int *)calloc(Grid.CellCount, sizeof(int));
-
-    Sim->HashGrid = Grid;
+// NOTE(said): A mapped particle array belongs to the checkpoint mapping.
+static void
+FreeSim(sim *Sim)
+{
+    if (Sim->ParticleMapping) {
+        UnmapFile(Sim->ParticleMapping, Sim->ParticleMappingSize);
+    } else {
+        FreeLarge(Sim->Particles);
+    }
+    FreeLarge(Sim->HashGrid.CellKeys);
+    FreeLarge(Sim->HashGrid.CellStart);
+    FreeLarge(Sim->HashGrid.CellEnd);
+    FreeArena(&Sim->StepArena);
 
-    Sim->Gravity = V2(0, -9.81f);
+    *Sim = {};
 }
@@ -1,60 +1,298 @@
 #define MAX_THREAD_COUNT 64
 
-#define PARTICLE_RADIUS 0.0125f
-#define PARTICLE_MASS 0.25f
-#define PARTICLES_PER_AXIS 200
-#define dt 0.008f
+#define MAX_NEIGHBORS 128
+
+enum grid_order {
+    GridOrder_RowMajor,
+    GridOrder_Morton,
+};
+
+// NOTE(said): Emits Rate particles per second at random points in the disc,
+// all moving at V. Zero rate or radius turns it off.
+struct particle_emitter {
+    v2 P;
+    float Radius;
+    float Rate;
+    v2 V;
+};
 
-#define REST_DENSITY 1000.0f
-#define RELAXATION 300.0f
+// NOTE(said): Removes every particle that ends a step inside the disc.
+struct particle_sink {
+    v2 P;
+    float Radius;
+};
 
-#define H 0.15f
-#define H2 (H*H)
-#define H6 (H*H*H*H*H*H)
-#define H9 (H*H*H*H*H*H*H*H*H)
+// NOTE(said): Everything that used to be a #define, so parameter sweeps
+// don't need a rebuild. See DefaultSimConfig for the defaults.
+struct sim_config {
+    int ParticlesPerAxis;
+    float ParticleRadius;
+    float ParticleMass;
+    float Dt;
 
-#define MAX_NEIGHBORS 128
+    // NOTE(said): With AdaptiveDt set, Dt is only the first step. After that
+    // each step is sized from the fastest particle (at most Cfl * H per step)
+    // and the density error of the last solve, within [MinDt, MaxDt].
+    int AdaptiveDt;
+    float MinDt;
+    float MaxDt;
+    float Cfl;
+    float MaxDensityError;
+
+    float RestDensity;
+    float Relaxation;
+    float H;
+
+    float ScorrK;
+    float ScorrDeltaQ;
+    float Elasticity;
+
+    float WorldWidth;
+    float WorldHeight;
+    v2 Gravity;
+
+    // NOTE(said): Morton ordering keeps spatially adjacent cells close together
+    // in the sorted particle array, so 3x3 neighbourhoods and work tiles stay compact.
+    grid_order GridOrder;
+
+    // NOTE(said): Visit every neighbour pair once in the density/lambda pass
+    // and write the result to both particles, see ComputeDensitySums.
+    int SymmetricLambda;
+
+    // NOTE(said): Run the position update in coloured block batches so the
+    // in-place Gauss-Seidel updates never race, see ComputeDeltaPBlocks.
+    int ColoredDeltaP;
+
+    // NOTE(said): Deterministic runs force every pass onto a fixed schedule
+    // and print a hash of the state after each step, so two runs (with any
+    // thread count) can be compared bit for bit.
+    int Deterministic;
+    int Seed;
+
+    // NOTE(said): Starting particles get a random velocity of up to this
+    // much along each axis, drawn from Seed.
+    float InitialJitter;
 
-#define WORLD_WIDTH 10.0f
-#define WORLD_HEIGHT 10.0f
+    // NOTE(said): Size of the particle pool, zero means just the starting
+    // particles. Emitters stop when the pool is full.
+    int ParticleCapacity;
+    particle_emitter Emitter;
+    particle_sink Sink;
+
+    // NOTE(said): Backing for the particles, the grid table and the step
+    // arena, see page_mode.
+    page_mode HugePages;
+};
+
+// NOTE(said): Cell coordinates are biased so that they are never negative
+// and fit in 16 bits, the key is built from the biased coordinates.
+#define HASH_GRID_COORD_BIAS 32768
+#define HASH_GRID_MAX_COORD 0xFFFE
+#define HASH_GRID_EMPTY_KEY 0xFFFFFFFF
+
+// NOTE(said): Removed particles get a key above every live one, so the sort
+// moves them to the end of the array and the live count drops.
+#define HASH_GRID_DEAD_KEY HASH_GRID_EMPTY_KEY
 
 struct hash_grid_cell {
     int x;
     int y;
+    uint32_t Key;
     int Index;
     int ParticleIndex;
+    int ParticleEnd;
+};
+
+// NOTE(said): A 3x3 neighbourhood is at most nine runs of the sorted
+// particle array, fewer once contiguous runs are merged.
+#define MAX_NEIGHBOR_RANGES 9
+
+struct particle_range {
+    int Start;
+    int End;
+};
+
+// NOTE(said): Cells are grouped into 2x2 blocks and the blocks are coloured
+// like a checkerboard with four colours. Two blocks of the same colour are at
+// least two cells apart, so a pass that writes to a cell and its forward
+// neighbours can run all the blocks of one colour at the same time.
+#define BLOCK_COLOR_COUNT 4
+
+struct scheduled_cell {
+    uint64_t SortKey;
+    int Slot;
+};
+
+struct cell_block {
+    int CellIndex;
+    int CellEnd;
+    int ParticleCount;
+};
+
+struct block_schedule {
+    int CellCount;
+    scheduled_cell *Cells;
+
+    int BlockCount;
+    cell_block *Blocks;
+
+    int ColorStart[BLOCK_COLOR_COUNT + 1];
+};
+
+// NOTE(said): Partial results for the per step diagnostics. Every work item
+// fills in its own and they are merged in work order after FinishWork, so
+// the result doesn't depend on which thread ran which item.
+struct sim_stats {
+    int ParticleCount;
+    float MaxSpeedSq;
+    float DensityErrorSum;
+    float MaxDensityError;
+    float CorrectionSum;
+    float MaxCorrectionSq;
+};
+
+// NOTE(said): Density errors are relative to the rest density and only count
+// compression, corrections are the position change of the last solve.
+struct sim_diagnostics {
+    float MaxSpeed;
+    float DensityError;
+    float MaxDensityError;
+    float Correction;
+    float MaxCorrection;
+};
+
+// NOTE(said): Per particle sums for the symmetric lambda pass, indexed like
+// the sorted particle array. Kept out of particle so the snapshot stays small.
+struct lambda_sums {
+    v2 Gradient;
+    float SquaredGradSum;
 };
 
 struct hash_grid {
     v2 WorldP;
     float CellDim;
+    float InvCellDim;
+    grid_order Order;
+    page_mode PageMode;
 
-    int Width;
-    int Height;
-    int CellCount;
-
+    // NOTE(said): Open addressing table keyed on the cell key, sized
+    // by the number of occupied cells rather than by the world size.
+    int TableBits;
+    int TableSize;
+    uint32_t *CellKeys;
     int *CellStart;
+    int *CellEnd;
 };
 
+// NOTE(said): Only what lives from one step to the next, every sort moves
+// all of it. The start of step position is P - V * dt, density and pressure
+// are in the step arena, see sim.
 struct particle {
-    v2 P0;
     v2 P;
     v2 V;
-    float Density;
-    float Pressure;
 
-    int CellIndex;
+    uint32_t CellKey;
+};
+
+struct random_series {
+    uint64_t State;
 };
 
 struct sim {
     float Time;
+    uint64_t StepIndex;
+
+    // NOTE(said): Dt is the size of the next step, LastDt the size of the
+    // one that got the particles where they are.
+    float Dt;
+    float LastDt;
 
+    // NOTE(said): From the last step, they drive the adaptive dt.
+    sim_diagnostics Diagnostics;
+
+    sim_config Config;
+    sim_kernel Kernel;
+
+    work_queue_proc ComputeLambdaProc;
+    work_queue_proc ComputeDensitySumsProc;
+    work_queue_proc ComputeLambdaFromSumsProc;
+    work_queue_proc ComputeDeltaPProc;
+    work_queue_proc ComputeDeltaPBlocksProc;
+
+    // NOTE(said): Live particles are [0, ParticleCount) of a pool with room
+    // for ParticleCapacity.
     int ParticleCount;
+    int ParticleCapacity;
     particle *Particles;
 
+    // NOTE(said): After a checkpoint restore Particles points into a private
+    // mapping of the file, it can't be realloc'd or freed. The mapping goes
+    // away once the particles move out of it.
+    uint8_t *ParticleMapping;
+    size_t ParticleMappingSize;
+
+    random_series Series;
+    float EmitAccumulator;
+
     hash_grid HashGrid;
     v2 Gravity;
 
+    // NOTE(said): Scratch for one step, reset at the start of Simulate. The
+    // schedule and the lambda sums live in it.
+    memory_arena StepArena;
+    block_schedule BlockSchedule;
+    lambda_sums *LambdaSums;
+
+    // NOTE(said): Per particle results of the last step, indexed like the
+    // sorted particle array. In the step arena too, so they're good until
+    // the next Simulate.
+    float *Densities;
+    float *Pressures;
+
     bool Pulling;
     v2 PullPoint;
 };
+
+// NOTE(said): Bytes held per subsystem, for the memory report. The sim
+// parts are filled in by CopySimSnapshot, export by whoever publishes.
+struct memory_usage {
+    size_t Particles;
+    size_t HashGrid;
+    size_t StepArena;
+    size_t StepArenaHighWater;
+    size_t Snapshot;
+    size_t Export;
+};
+
+// NOTE(said): An immutable copy of the simulation state for the renderer.
+// The grid is the one the sim built at the start of the step, so particles
+// may have drifted a little from their cells, which is fine for drawing.
+struct sim_snapshot {
+    float Time;
+    float Dt;
+
+    // NOTE(said): Only needed to checkpoint from a snapshot.
+    uint64_t StepIndex;
+    float NextDt;
+    v2 Gravity;
+    random_series Series;
+    float EmitAccumulator;
+
+    sim_config Config;
+
+    // NOTE(said): Pacing info filled in by whoever publishes the snapshot,
+    // the renderer uses it to interpolate over the last step.
+    float Lag;
+    float TimeScale;
+    float RealTimeFactor;
+    uint64_t PublishCounter;
+
+    sim_diagnostics Diagnostics;
+    memory_usage Memory;
+
+    int ParticleCount;
+    int ParticleCapacity;
+    particle *Particles;
+
+    hash_grid HashGrid;
+};